@@ -3,7 +3,49 @@
 #include "Python.h"
 #include "structmember.h"
 #include "frameobject.h"
-#include "code.h"
+#ifdef MS_WINDOWS
+#include <time.h>
+#else
+#include <sys/time.h>
+#endif
+
+/* Frame access layer. Up to Python 3.10 the frame members are public
+ * structure members and the accessors compile to a direct load. On Python
+ * 3.11 the frame object is opaque and backed by a lightweight interpreter
+ * frame; the build then defines BDB_INTERNAL_FRAME_API (see setup.py) and
+ * the accessors read straight from the interpreter frame through the
+ * internal header, so that the tracer does not pay a function call and a
+ * reference count pair on every debug event. */
+#ifdef BDB_INTERNAL_FRAME_API
+#include "internal/pycore_frame.h"
+#define FRAME_CODE(f)       ((f)->f_frame->f_code)
+#define FRAME_LOCALS(f)     ((f)->f_frame->f_locals)
+#define FRAME_GLOBALS(f)    ((f)->f_frame->f_globals)
+#define FRAME_LOCAL(f, i)   ((f)->f_frame->localsplus[i])
+
+/* Return a borrowed reference to the caller's frame object, materializing
+ * it when the interpreter has not created it yet. Once materialized the
+ * frame object is owned by its interpreter frame. */
+static PyFrameObject *
+frame_back(PyFrameObject *frame)
+{
+    PyFrameObject *back = PyFrame_GetBack(frame);
+    Py_XDECREF(back);
+    return back;
+}
+#else
+#define FRAME_CODE(f)       ((f)->f_code)
+#define FRAME_LOCALS(f)     ((f)->f_locals)
+#define FRAME_GLOBALS(f)    ((f)->f_globals)
+#define FRAME_LOCAL(f, i)   ((f)->f_localsplus[i])
+#define frame_back(f)       ((f)->f_back)
+#endif
+
+/* Watchpoints are implemented with per-frame opcode tracing through
+ * f_trace_opcodes, a Python 3.7 feature. */
+#if PY_VERSION_HEX >= 0x03070000
+#define BDB_WATCHPOINTS 1
+#endif
 
 /* The trace function receives all the PyTrace_LINE events, even when f_trace
  * is NULL. The interpreter calls _PyCode_CheckLineNumber() for each of these
@@ -15,6 +57,167 @@
 */
 #define TRACE_AND_PROFILE 1
 
+/* On Python 3.6 and above, the result of the breakpoint lookup made by
+ * bkpt_in_code() is cached in a co_extra slot of the code object itself
+ * (PEP 523), so that any number of concurrently hot functions get the fast
+ * path. A one-entry cache thrashes on recursive code or on tight mutual
+ * calls between two functions with breakpoints. */
+#if PY_VERSION_HEX >= 0x03060000
+#define BDB_CO_EXTRA 1
+#endif
+
+#ifdef BDB_CO_EXTRA
+/* The breakpoint lookup result for one code object, stored in a co_extra
+ * slot of the code object. An entry is stale when its generation does not
+ * match bkpt_generation, which is incremented whenever the set of
+ * breakpoints changes. Stale entries are released lazily, when overwritten
+ * or when their code object is deallocated. The entries are reference
+ * counted: one reference is owned by the co_extra slot and one by the
+ * tracer whose one-entry cache borrows the line bitmap. */
+typedef struct {
+    Py_ssize_t refcnt;
+    void *tracer;           /* The owning tracer, compared by identity. */
+    size_t generation;
+    PyObject *module_bps;   /* NULL when the code object has no breakpoint. */
+    PyObject *code_bps;
+    unsigned char *linebmap;
+    Py_ssize_t linebmap_size;
+} bkpt_cache;
+
+static Py_ssize_t co_extra_index = -1;
+static size_t bkpt_generation = 0;
+
+static void
+bkpt_cache_release(bkpt_cache *cache)
+{
+    if (cache != NULL && --cache->refcnt == 0) {
+        Py_XDECREF(cache->module_bps);
+        Py_XDECREF(cache->code_bps);
+        if (cache->linebmap != NULL)
+            PyMem_Free(cache->linebmap);
+        PyMem_Free(cache);
+    }
+}
+
+/* The freefunc registered with the co_extra index. */
+static void
+bkpt_cache_free(void *cache)
+{
+    bkpt_cache_release((bkpt_cache *)cache);
+}
+#endif
+
+/* Process-wide table mapping a co_filename object, looked up by pointer
+ * identity, to its lower case form. Identical filenames are almost always
+ * the same interned object, so a hit costs a pointer hash and compare, and
+ * no unicode hashing. The table is shared by all tracer instances and by
+ * canonic() in the bdb module, so multiple Pdb instances (debug of debug,
+ * per-thread tracers) do not re-fold the same filenames. Entries hold strong
+ * references and are never evicted: the set of filenames seen by a process
+ * is small and bounded. */
+typedef struct {
+    PyObject *filename;
+    PyObject *lc_filename;
+} lcfilename_entry;
+
+static lcfilename_entry *lcfilename_table = NULL;
+static Py_ssize_t lcfilename_mask = 0;
+static Py_ssize_t lcfilename_used = 0;
+
+/* Return a borrowed reference to the lower case form, or NULL when the
+ * filename is not in the table. */
+static PyObject *
+lcfilename_get(PyObject *filename)
+{
+    Py_ssize_t j;
+
+    if (lcfilename_table == NULL)
+        return NULL;
+    j = ((Py_uintptr_t)filename >> 4) & lcfilename_mask;
+    while (lcfilename_table[j].filename != NULL) {
+        if (lcfilename_table[j].filename == filename)
+            return lcfilename_table[j].lc_filename;
+        j = (j + 1) & lcfilename_mask;
+    }
+    return NULL;
+}
+
+static int
+lcfilename_set(PyObject *filename, PyObject *lc_filename)
+{
+    Py_ssize_t j;
+
+    /* Keep the load factor below 1/2. */
+    if (lcfilename_table == NULL ||
+            2 * (lcfilename_used + 1) > lcfilename_mask + 1) {
+        lcfilename_entry *table = lcfilename_table;
+        Py_ssize_t size = table != NULL ? 2 * (lcfilename_mask + 1) : 64;
+        Py_ssize_t i;
+
+        lcfilename_table = PyMem_Malloc(size * sizeof(lcfilename_entry));
+        if (lcfilename_table == NULL) {
+            lcfilename_table = table;
+            PyErr_NoMemory();
+            return -1;
+        }
+        memset(lcfilename_table, 0, size * sizeof(lcfilename_entry));
+        lcfilename_mask = size - 1;
+        if (table != NULL) {
+            for (i = 0; i < size / 2; i++) {
+                if (table[i].filename == NULL)
+                    continue;
+                j = ((Py_uintptr_t)table[i].filename >> 4) & lcfilename_mask;
+                while (lcfilename_table[j].filename != NULL)
+                    j = (j + 1) & lcfilename_mask;
+                lcfilename_table[j] = table[i];
+            }
+            PyMem_Free(table);
+        }
+    }
+
+    j = ((Py_uintptr_t)filename >> 4) & lcfilename_mask;
+    while (lcfilename_table[j].filename != NULL) {
+        if (lcfilename_table[j].filename == filename)
+            return 0;
+        j = (j + 1) & lcfilename_mask;
+    }
+    Py_INCREF(filename);
+    Py_INCREF(lc_filename);
+    lcfilename_table[j].filename = filename;
+    lcfilename_table[j].lc_filename = lc_filename;
+    lcfilename_used++;
+    return 0;
+}
+
+/* Return a new reference to the lower case form of the filename, folding
+ * and caching it when not yet in the table. */
+static PyObject *
+lcfilename_fold(PyObject *filename)
+{
+    PyObject *lc_filename;
+
+    lc_filename = lcfilename_get(filename);
+    if (lc_filename == NULL) {
+        lc_filename = PyObject_CallMethod(filename, "lower", NULL);
+        if (lc_filename == NULL)
+            return NULL;
+        if (lcfilename_set(filename, lc_filename) != 0) {
+            Py_DECREF(lc_filename);
+            return NULL;
+        }
+        return lc_filename;
+    }
+    Py_INCREF(lc_filename);
+    return lc_filename;
+}
+
+/* One record of the flight recorder ring buffer. */
+typedef struct {
+    PyCodeObject *code;         /* Strong reference, NULL in unused slots. */
+    int event;                  /* PyTrace_CALL or PyTrace_RETURN. */
+    double timestamp;
+} flight_entry;
+
 typedef struct {
     PyObject_HEAD
 
@@ -22,11 +225,26 @@ typedef struct {
     PyObject *trace_dispatch;
     PyObject *breakpoints;
     PyObject *botframe;
-    PyObject *quitting;
     PyObject *topframe;
     PyObject *topframe_locals;
     PyObject *stopframe;
-    PyObject *stop_lineno;
+    /* The stepping state is kept as plain C values so that stop_here(),
+     * trace_call() and trace_return() do not unbox a PyObject at each debug
+     * event. The Python side reads and writes them through the member
+     * descriptors. */
+    int stop_lineno;
+    char quitting;
+    /* An exception class or tuple of exception classes, None by default.
+     * When no stepping is active, a PyTrace_EXCEPTION event costs at most
+     * two pointer compares unless the raised exception matches this filter,
+     * in which case a user_exception event is generated. */
+    PyObject *break_exceptions;
+    /* A dictionary mapping a frame with watchpoints to the list of its
+     * entries, each entry a [name, fast slot index, old value] list managed
+     * by Bdb.set_watch(). Only the frames in this dictionary have
+     * f_trace_opcodes set, so the PyTrace_OPCODE events are confined to
+     * them. */
+    PyObject *watchpoints;
     PyObject *skip_modules;
     PyObject *skip_calls;
     PyObject *linenumbers;      /* The list of cached line number objects.
@@ -35,8 +253,20 @@ typedef struct {
 
     /* Internals */
     int ignore_first_call_event;
-    PyObject *lcfilename_cache; /* Dictionary mapping a co_filename object
-                                 * to its co_filename.lower() object. */
+    int to_lowercase;           /* Fold filenames to lower case, using the
+                                 * process-wide lcfilename_table. */
+    PyObject *skip_cache;       /* Dictionary mapping a code object to the
+                                 * is_skipped_module() verdict for that code,
+                                 * so that the Python-level matching over
+                                 * skip_modules runs only once per code
+                                 * object. */
+
+    /* An open addressed hash set of the code object pointers of the
+     * skip_calls tuple, giving O(1) filtering at PyTrace_CALL events. The
+     * pointers are borrowed from the skip_calls tuple whose lifetime is the
+     * one of the tracer. */
+    PyObject **skip_calls_set;
+    Py_ssize_t skip_calls_mask;
 
     /* The following three references are used to avoid a call to bkpt_in_code
      * when tracing lines in the same function (a performance gain of 14-28 %).
@@ -45,8 +275,106 @@ typedef struct {
     PyObject *module_bps;       /* The current module_bps object. */
     PyObject *code_bps;         /* The current code_bps object. */
     PyCodeObject *f_code;       /* The current f_code object. */
+
+    /* Bitmap of the line numbers that are keys of the current code_bps
+     * dictionary, one bit per line. With the bitmap, the line check at a
+     * PyTrace_LINE event is an array index and a bit test, and the
+     * dictionary machinery is only used on a hit. The bdb Python module
+     * invalidates the bitmap with bkpt_invalidate() whenever the set of
+     * breakpoints changes. On co_extra builds, the bitmap is borrowed from
+     * cur_cache. */
+    unsigned char *linebmap;
+    Py_ssize_t linebmap_size;   /* The bitmap size in bytes. */
+
+#ifdef BDB_CO_EXTRA
+    /* The cache entry of the current f_code, owning the line bitmap that
+     * linebmap borrows. */
+    bkpt_cache *cur_cache;
+#endif
+
+    /* Statistics, plain C increments on the per-event path, exposed by the
+     * stats() method and cleared by reset_stats(). They quantify the
+     * debugging overhead on a given workload and breakpoint set. */
+    unsigned long long ev_line;
+    unsigned long long ev_call;
+    unsigned long long ev_return;
+    unsigned long long ev_exception;
+    unsigned long long swap_count;          /* tracer <-> profiler swaps */
+    unsigned long long bkpt_cache_hits;     /* breakpoint lookup caches */
+    unsigned long long bkpt_cache_misses;
+    unsigned long long lcfilename_hits;     /* lcfilename_table lookups */
+    unsigned long long lcfilename_misses;
+
+    /* Flight recorder: a fixed size, preallocated, overwrite-oldest ring
+     * buffer of the CALL and RETURN events, recorded by both the tracer and
+     * the profiler at the cost of a pointer copy and a clock read. NULL
+     * when disabled, see set_flight_recorder(). */
+    flight_entry *flightrec;
+    Py_ssize_t flightrec_size;
+    Py_ssize_t flightrec_next;
+    unsigned long long flightrec_count;
 } BdbTracer;
 
+static void
+reset_stats(BdbTracer *self)
+{
+    self->ev_line = 0;
+    self->ev_call = 0;
+    self->ev_return = 0;
+    self->ev_exception = 0;
+    self->swap_count = 0;
+    self->bkpt_cache_hits = 0;
+    self->bkpt_cache_misses = 0;
+    self->lcfilename_hits = 0;
+    self->lcfilename_misses = 0;
+}
+
+static double
+flight_timestamp(void)
+{
+#ifdef MS_WINDOWS
+    return (double)clock() / CLOCKS_PER_SEC;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+#endif
+}
+
+static void
+flight_record(BdbTracer *self, PyCodeObject *code, int what)
+{
+    flight_entry *entry;
+
+    if (self->flightrec == NULL)
+        return;
+    entry = self->flightrec + self->flightrec_next;
+    Py_INCREF(code);
+    Py_XDECREF(entry->code);
+    entry->code = code;
+    entry->event = what;
+    entry->timestamp = flight_timestamp();
+    if (++self->flightrec_next == self->flightrec_size)
+        self->flightrec_next = 0;
+    self->flightrec_count++;
+}
+
+static void
+flight_free(BdbTracer *self)
+{
+    Py_ssize_t i;
+
+    if (self->flightrec != NULL) {
+        for (i = 0; i < self->flightrec_size; i++)
+            Py_XDECREF(self->flightrec[i].code);
+        PyMem_Free(self->flightrec);
+        self->flightrec = NULL;
+    }
+    self->flightrec_size = 0;
+    self->flightrec_next = 0;
+    self->flightrec_count = 0;
+}
+
 /* Forward declarations. */
 static int tracer(PyObject *, PyFrameObject *, int, PyObject *);
 static PyObject * trace_call(BdbTracer *, PyFrameObject *, PyObject *);
@@ -65,14 +393,21 @@ BdbTracer_members[] = {
                   " instances.")},
     {"botframe", T_OBJECT, offsetof(BdbTracer, botframe), 0,
         PyDoc_STR("The oldest frame.")},
-    {"quitting", T_OBJECT, offsetof(BdbTracer, quitting), 0,
+    {"quitting", T_BOOL, offsetof(BdbTracer, quitting), 0,
         PyDoc_STR("Quit the debugging session when True.")},
     {"topframe", T_OBJECT, offsetof(BdbTracer, topframe), 0,
         PyDoc_STR("The current frame.")},
     {"topframe_locals", T_OBJECT, offsetof(BdbTracer, topframe_locals), 0,
         PyDoc_STR("The f_locals dictionary.")},
     {"stopframe", T_OBJECT, offsetof(BdbTracer, stopframe), 0, NULL},
-    {"stop_lineno", T_OBJECT, offsetof(BdbTracer, stop_lineno), 0, NULL},
+    {"stop_lineno", T_INT, offsetof(BdbTracer, stop_lineno), 0, NULL},
+    {"break_exceptions", T_OBJECT, offsetof(BdbTracer, break_exceptions), 0,
+        PyDoc_STR("An exception class or tuple of exception classes that"
+                  " generate a user_exception event when raised while no"
+                  " stepping is active, None by default.")},
+    {"watchpoints", T_OBJECT, offsetof(BdbTracer, watchpoints), 0,
+        PyDoc_STR("A dictionary mapping a frame with watchpoints to the"
+                  " list of its entries.")},
     {"skip_modules", T_OBJECT, offsetof(BdbTracer, skip_modules), 0, NULL},
     {"skip_calls", T_OBJECT, offsetof(BdbTracer, skip_calls), 0, NULL},
     {"linenumbers", T_OBJECT, offsetof(BdbTracer, linenumbers), 0, NULL},
@@ -89,18 +424,36 @@ BdbTracer_init(BdbTracer *self, PyObject *args, PyObject *kwds)
 
     self->breakpoints = NULL;
     self->botframe = NULL;
-    self->quitting = NULL;
+    self->quitting = 0;
     self->topframe = NULL;
     self->topframe_locals = NULL;
     self->stopframe = NULL;
-    self->stop_lineno = NULL;
+    self->stop_lineno = 0;
+    self->break_exceptions = NULL;
+    self->watchpoints = NULL;
     self->skip_modules = NULL;
     self->skip_calls = NULL;
     self->linenumbers = NULL;
     self->module_bps = NULL;
     self->code_bps = NULL;
     self->f_code = NULL;
-    self->lcfilename_cache = NULL;
+    self->to_lowercase = 0;
+    self->skip_cache = NULL;
+    self->skip_calls_set = NULL;
+    self->skip_calls_mask = 0;
+    self->linebmap = NULL;
+    self->linebmap_size = 0;
+#ifdef BDB_CO_EXTRA
+    self->cur_cache = NULL;
+    /* Invalidate the co_extra entries possibly left over by a tracer
+     * previously allocated at the same address. */
+    bkpt_generation++;
+#endif
+    self->flightrec = NULL;
+    self->flightrec_size = 0;
+    self->flightrec_next = 0;
+    self->flightrec_count = 0;
+    reset_stats(self);
 
     if (! PyArg_ParseTupleAndKeywords(args, kwds, "O!|O!O!:init", kwlist,
             &PyBool_Type, &lowercase,
@@ -111,11 +464,7 @@ BdbTracer_init(BdbTracer *self, PyObject *args, PyObject *kwds)
     /* Use a borrowed reference to avoid a cycle. */
     self->trace_dispatch = (PyObject *)self;
 
-    if (lowercase == Py_True) {
-        self->lcfilename_cache = PyDict_New();
-        if (self->lcfilename_cache == NULL)
-            goto fail;
-    }
+    self->to_lowercase = (lowercase == Py_True);
 
     if (self->skip_modules == NULL) {
         self->skip_modules = Py_BuildValue("()");
@@ -137,10 +486,46 @@ BdbTracer_init(BdbTracer *self, PyObject *args, PyObject *kwds)
     if (self->breakpoints == NULL)
         goto fail;
 
+    self->skip_cache = PyDict_New();
+    if (self->skip_cache == NULL)
+        goto fail;
+
+    self->watchpoints = PyDict_New();
+    if (self->watchpoints == NULL)
+        goto fail;
+
+    if (PyTuple_GET_SIZE(self->skip_calls)) {
+        Py_ssize_t len = PyTuple_GET_SIZE(self->skip_calls);
+        Py_ssize_t size = 8;
+        Py_ssize_t i, j;
+
+        /* Keep the load factor below 1/4. */
+        while (size < 4 * len)
+            size <<= 1;
+        self->skip_calls_set = PyMem_Malloc(size * sizeof(PyObject *));
+        if (self->skip_calls_set == NULL) {
+            PyErr_NoMemory();
+            goto fail;
+        }
+        memset(self->skip_calls_set, 0, size * sizeof(PyObject *));
+        self->skip_calls_mask = size - 1;
+        for (i = 0; i < len; i++) {
+            PyObject *code = PyTuple_GET_ITEM(self->skip_calls, i);
+            j = ((Py_uintptr_t)code >> 4) & self->skip_calls_mask;
+            while (self->skip_calls_set[j] != NULL &&
+                    self->skip_calls_set[j] != code)
+                j = (j + 1) & self->skip_calls_mask;
+            self->skip_calls_set[j] = code;
+        }
+    }
+
     self->linenumbers = PyList_New(0);
     if (self->linenumbers == NULL)
         goto fail;
 
+    Py_INCREF(Py_None);
+    self->break_exceptions = Py_None;
+
     result = PyObject_CallMethod((PyObject *)self, "reset", NULL);
     if (result == NULL)
         goto fail;
@@ -153,56 +538,192 @@ fail:
     Py_XDECREF(self->skip_calls);
     Py_XDECREF(self->breakpoints);
     Py_XDECREF(self->linenumbers);
-    Py_XDECREF(self->lcfilename_cache);
+    Py_XDECREF(self->skip_cache);
+    Py_XDECREF(self->watchpoints);
+    if (self->skip_calls_set != NULL)
+        PyMem_Free(self->skip_calls_set);
     return -1;
 }
 
+/* True when the code object pointer is in the skip_calls hash set. The code
+ * objects registered in skip_calls are looked up by identity. */
+static int
+in_skip_calls(BdbTracer *self, PyCodeObject *code)
+{
+    Py_ssize_t j;
+
+    if (self->skip_calls_set == NULL)
+        return 0;
+    j = ((Py_uintptr_t)code >> 4) & self->skip_calls_mask;
+    while (self->skip_calls_set[j] != NULL) {
+        if (self->skip_calls_set[j] == (PyObject *)code)
+            return 1;
+        j = (j + 1) & self->skip_calls_mask;
+    }
+    return 0;
+}
+
 static void
 BdbTracer_dealloc(BdbTracer *self)
 {
     Py_XDECREF(self->breakpoints);
     Py_XDECREF(self->botframe);
-    Py_XDECREF(self->quitting);
     Py_XDECREF(self->topframe);
     Py_XDECREF(self->topframe_locals);
     Py_XDECREF(self->stopframe);
-    Py_XDECREF(self->stop_lineno);
+    Py_XDECREF(self->break_exceptions);
+    Py_XDECREF(self->watchpoints);
     Py_XDECREF(self->skip_modules);
     Py_XDECREF(self->skip_calls);
     Py_XDECREF(self->linenumbers);
     Py_XDECREF(self->module_bps);
     Py_XDECREF(self->code_bps);
     Py_XDECREF(self->f_code);
-    Py_XDECREF(self->lcfilename_cache);
+    Py_XDECREF(self->skip_cache);
+    if (self->skip_calls_set != NULL)
+        PyMem_Free(self->skip_calls_set);
+#ifdef BDB_CO_EXTRA
+    bkpt_cache_release(self->cur_cache);
+#else
+    if (self->linebmap != NULL)
+        PyMem_Free(self->linebmap);
+#endif
+    flight_free(self);
     Py_TYPE(self)->tp_free((PyObject*)self);
 }
 
+/* Build the bitmap of the line numbers that are keys of code_bps. */
+static int
+build_linebmap(PyObject *code_bps, unsigned char **bmapp, Py_ssize_t *sizep)
+{
+    PyObject *key, *value;
+    Py_ssize_t pos = 0;
+    long max_lineno = 0;
+    long lineno;
+    unsigned char *bmap;
+    Py_ssize_t size;
+
+    if (*bmapp != NULL) {
+        PyMem_Free(*bmapp);
+        *bmapp = NULL;
+        *sizep = 0;
+    }
+    while (PyDict_Next(code_bps, &pos, &key, &value)) {
+        lineno = PyLong_AsLong(key);
+        if (lineno == -1 && PyErr_Occurred())
+            return -1;
+        if (lineno > max_lineno)
+            max_lineno = lineno;
+    }
+    size = max_lineno / 8 + 1;
+    bmap = PyMem_Malloc(size);
+    if (bmap == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    memset(bmap, 0, size);
+    pos = 0;
+    while (PyDict_Next(code_bps, &pos, &key, &value)) {
+        lineno = PyLong_AsLong(key);
+        if (lineno == -1 && PyErr_Occurred()) {
+            PyMem_Free(bmap);
+            return -1;
+        }
+        bmap[lineno / 8] |= (unsigned char)(1 << (lineno % 8));
+    }
+    *bmapp = bmap;
+    *sizep = size;
+    return 0;
+}
+
+#ifdef BDB_CO_EXTRA
+/* Return a new cache entry with one reference, or NULL on error. A NULL
+ * module_bps records that the code object has no breakpoint. */
+static bkpt_cache *
+bkpt_cache_new(BdbTracer *self, PyObject *module_bps, PyObject *code_bps)
+{
+    bkpt_cache *cache = PyMem_Malloc(sizeof(bkpt_cache));
+
+    if (cache == NULL) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    cache->refcnt = 1;
+    cache->tracer = (void *)self;
+    cache->generation = bkpt_generation;
+    Py_XINCREF(module_bps);
+    cache->module_bps = module_bps;
+    Py_XINCREF(code_bps);
+    cache->code_bps = code_bps;
+    cache->linebmap = NULL;
+    cache->linebmap_size = 0;
+    if (code_bps != NULL && build_linebmap(code_bps,
+            &cache->linebmap, &cache->linebmap_size) == -1) {
+        bkpt_cache_release(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+/* Make the entry the current one of the one-entry cache. Steals a reference
+ * to the entry. */
+static void
+set_cur_cache(BdbTracer *self, bkpt_cache *cache, PyCodeObject *f_code)
+{
+    Py_INCREF(cache->module_bps);
+    Py_XDECREF(self->module_bps);
+    self->module_bps = cache->module_bps;
+
+    Py_INCREF(cache->code_bps);
+    Py_XDECREF(self->code_bps);
+    self->code_bps = cache->code_bps;
+
+    Py_INCREF(f_code);
+    Py_XDECREF(self->f_code);
+    self->f_code = f_code;
+
+    bkpt_cache_release(self->cur_cache);
+    self->cur_cache = cache;
+    self->linebmap = cache->linebmap;
+    self->linebmap_size = cache->linebmap_size;
+}
+#endif
+
 static int
 stop_here(BdbTracer *self, PyFrameObject *frame)
 {
     PyObject *result;
-    int lineno;
 
     if (PyTuple_GET_SIZE(self->skip_modules)) {
-        result = PyObject_CallMethod((PyObject *)self, "is_skipped_module",
-                                     "(O)", frame);
-        if (result == NULL)
-            return -1;
-        if (PyObject_IsTrue(result)) {
+        /* The verdict is computed once per code object and cached, so the
+         * Python-level fnmatch over skip_modules does not run at each debug
+         * event. */
+        result = PyDict_GetItem(self->skip_cache, (PyObject *)FRAME_CODE(frame));
+        if (result == NULL) {
+            int skipped;
+
+            result = PyObject_CallMethod((PyObject *)self,
+                                         "is_skipped_module", "(O)", frame);
+            if (result == NULL)
+                return -1;
+            skipped = PyObject_IsTrue(result);
             Py_DECREF(result);
-            return 0;
+            if (skipped == -1)
+                return -1;
+            if (PyDict_SetItem(self->skip_cache, (PyObject *)FRAME_CODE(frame),
+                               skipped ? Py_True : Py_False) != 0)
+                return -1;
+            if (skipped)
+                return 0;
         }
-        Py_DECREF(result);
+        else if (result == Py_True)
+            return 0;
     }
 
-    lineno = PyLong_AsLong(self->stop_lineno);
-    if (lineno == -1 && PyErr_Occurred())
-        return -1;
-
     if ((PyObject *)frame == self->stopframe || self->stopframe == Py_None) {
-        if (lineno == -1)
+        if (self->stop_lineno == -1)
             return 0;
-        return frame->f_lineno >= lineno;
+        return frame->f_lineno >= self->stop_lineno;
     }
 
     return 0;
@@ -211,37 +732,74 @@ stop_here(BdbTracer *self, PyFrameObject *frame)
 static PyObject *
 bkpt_in_code(BdbTracer *self, PyFrameObject *frame)
 {
-    PyObject *filename = frame->f_code->co_filename;
+    PyObject *filename = FRAME_CODE(frame)->co_filename;
     PyObject *result = NULL;
     PyObject *lc_filename = NULL;
     PyObject *firstlineno;
     PyObject *module_bps;
     PyObject *code_bps;
+#ifdef BDB_CO_EXTRA
+    bkpt_cache *cache = NULL;
+
+    if (co_extra_index != -1 &&
+            _PyCode_GetExtra((PyObject *)FRAME_CODE(frame), co_extra_index,
+                             (void **)&cache) == 0 &&
+            cache != NULL && cache->tracer == (void *)self &&
+            cache->generation == bkpt_generation) {
+        self->bkpt_cache_hits++;
+        if (cache->module_bps == NULL) {
+            /* The code object has no breakpoint. */
+            Py_INCREF(Py_None);
+            return Py_None;
+        }
+        cache->refcnt++;
+        set_cur_cache(self, cache, FRAME_CODE(frame));
+        Py_INCREF(cache->module_bps);
+        return cache->module_bps;
+    }
+#endif
 
-    if (self->lcfilename_cache != NULL) {
-        lc_filename = PyDict_GetItem(self->lcfilename_cache, filename);
-        if (lc_filename == NULL) {
-            lc_filename = PyObject_CallMethod(filename, "lower", NULL);
+    self->bkpt_cache_misses++;
+
+    if (self->to_lowercase) {
+        lc_filename = lcfilename_get(filename);
+        if (lc_filename != NULL) {
+            self->lcfilename_hits++;
+            Py_INCREF(lc_filename);
+        }
+        else {
+            self->lcfilename_misses++;
+            lc_filename = lcfilename_fold(filename);
             if (lc_filename == NULL)
                 return NULL;
-            if (PyDict_SetItem(self->lcfilename_cache, filename, lc_filename)){
-                Py_DECREF(lc_filename);
-                return NULL;
-            }
         }
-        else
-            Py_INCREF(lc_filename);
         filename = lc_filename;
     }
 
     module_bps = PyDict_GetItem(self->breakpoints, filename);
-    if (module_bps != NULL && frame->f_code->co_firstlineno <
+    if (module_bps != NULL && FRAME_CODE(frame)->co_firstlineno <
             PyList_GET_SIZE(self->linenumbers)) {
         firstlineno = PyList_GET_ITEM(self->linenumbers,
-                                      frame->f_code->co_firstlineno);
+                                      FRAME_CODE(frame)->co_firstlineno);
         if (firstlineno != Py_None) {
             code_bps = PyDict_GetItem(module_bps, firstlineno);
             if (code_bps != NULL) {
+#ifdef BDB_CO_EXTRA
+                cache = bkpt_cache_new(self, module_bps, code_bps);
+                if (cache == NULL)
+                    goto fin;
+                if (co_extra_index != -1) {
+                    cache->refcnt++;
+                    if (_PyCode_SetExtra((PyObject *)FRAME_CODE(frame),
+                            co_extra_index, (void *)cache) != 0) {
+                        PyErr_Clear();
+                        cache->refcnt--;
+                    }
+                }
+                set_cur_cache(self, cache, FRAME_CODE(frame));
+#else
+                int new_code_bps = (code_bps != self->code_bps);
+
                 Py_INCREF(module_bps);
                 Py_XDECREF(self->module_bps);
                 self->module_bps = module_bps;
@@ -250,9 +808,17 @@ bkpt_in_code(BdbTracer *self, PyFrameObject *frame)
                 Py_XDECREF(self->code_bps);
                 self->code_bps = code_bps;
 
-                Py_INCREF(frame->f_code);
+                Py_INCREF(FRAME_CODE(frame));
                 Py_XDECREF(self->f_code);
-                self->f_code = frame->f_code;
+                self->f_code = FRAME_CODE(frame);
+
+                if ((new_code_bps || self->linebmap == NULL) &&
+                        build_linebmap(self->code_bps, &self->linebmap,
+                                       &self->linebmap_size) == -1) {
+                    result = NULL;
+                    goto fin;
+                }
+#endif
 
                 Py_INCREF(module_bps);
                 result = module_bps;
@@ -261,6 +827,22 @@ bkpt_in_code(BdbTracer *self, PyFrameObject *frame)
         }
     }
 
+#ifdef BDB_CO_EXTRA
+    /* Record that the code object has no breakpoint, so the filename and
+     * dictionary lookups above do not run again at each debug event of this
+     * code object. */
+    if (co_extra_index != -1) {
+        cache = bkpt_cache_new(self, NULL, NULL);
+        if (cache == NULL)
+            goto fin;
+        if (_PyCode_SetExtra((PyObject *)FRAME_CODE(frame), co_extra_index,
+                             (void *)cache) != 0) {
+            PyErr_Clear();
+            bkpt_cache_release(cache);
+        }
+    }
+#endif
+
     Py_INCREF(Py_None);
     result = Py_None;
 
@@ -277,7 +859,19 @@ bkpt_at_line(BdbTracer *self, PyFrameObject *frame)
     PyObject *lineno;
     int haskey;
 
-    if (frame->f_code == self->f_code) {
+    if (FRAME_CODE(frame) == self->f_code) {
+        self->bkpt_cache_hits++;
+        /* An array index and a bit test handle most of the PyTrace_LINE
+         * events of a function with breakpoints. */
+        if (self->linebmap != NULL) {
+            long f_lineno = frame->f_lineno;
+            if (f_lineno / 8 >= self->linebmap_size ||
+                    ! (self->linebmap[f_lineno / 8] &
+                        (unsigned char)(1 << (f_lineno % 8)))) {
+                Py_INCREF(Py_None);
+                return Py_None;
+            }
+        }
         module_bps = self->module_bps;
         Py_INCREF(module_bps);
     }
@@ -308,11 +902,241 @@ fin:
     return result;
 }
 
+/* Return the condition of the breakpoint compiled to a code object (a new
+ * reference), or Py_None when the condition does not compile. The compiled
+ * code is cached on the breakpoint instance and recompiled when the 'cond'
+ * attribute changes. */
+static PyObject *
+get_cond_code(PyObject *bp, PyObject *cond)
+{
+    PyObject *source;
+    PyObject *code;
+    const char *str;
+
+    source = PyObject_GetAttrString(bp, "_cond_source");
+    if (source == NULL)
+        PyErr_Clear();
+    else {
+        if (source == cond) {
+            Py_DECREF(source);
+            return PyObject_GetAttrString(bp, "_cond_code");
+        }
+        Py_DECREF(source);
+    }
+
+    str = PyUnicode_AsUTF8(cond);
+    if (str == NULL) {
+        PyErr_Clear();
+        code = Py_None;
+        Py_INCREF(code);
+    }
+    else {
+        code = Py_CompileString(str, "<breakpoint condition>", Py_eval_input);
+        if (code == NULL) {
+            PyErr_Clear();
+            code = Py_None;
+            Py_INCREF(code);
+        }
+    }
+
+    if (PyObject_SetAttrString(bp, "_cond_source", cond) != 0 ||
+            PyObject_SetAttrString(bp, "_cond_code", code) != 0) {
+        Py_DECREF(code);
+        return NULL;
+    }
+    return code;
+}
+
+/* Evaluate in place the breakpoints set at the current line and return the
+ * 'breakpoint_hits' tuple expected by user_line(), or Py_None when no
+ * breakpoint is effective. This mirrors Breakpoint.process_hit_event and
+ * Bdb.bkpt_user_line in the bdb module: a disabled breakpoint, a false
+ * condition or a positive ignore count is handled here without the cost of a
+ * full debugger round-trip through user_method(). */
+static PyObject *
+bkpt_effective(BdbTracer *self, PyFrameObject *frame)
+{
+    PyObject *bplist;
+    PyObject *lineno;
+    PyObject *effective = NULL;
+    PyObject *temporaries = NULL;
+    PyObject *f_locals = NULL;
+    PyObject *result = NULL;
+    Py_ssize_t i;
+
+    if (frame->f_lineno >= PyList_GET_SIZE(self->linenumbers)) {
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+    lineno = PyList_GET_ITEM(self->linenumbers, frame->f_lineno);
+    bplist = PyDict_GetItem(self->code_bps, lineno);
+    if (bplist == NULL) {
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+
+    effective = PyList_New(0);
+    if (effective == NULL)
+        goto fin;
+    temporaries = PyList_New(0);
+    if (temporaries == NULL)
+        goto fin;
+
+    for (i = 0; i < PyList_GET_SIZE(bplist); i++) {
+        PyObject *bp = PyList_GET_ITEM(bplist, i);
+        PyObject *attr;
+        PyObject *number;
+        long value;
+        int stop = 1;
+        int cond_error = 0;
+        int istrue;
+
+        attr = PyObject_GetAttrString(bp, "enabled");
+        if (attr == NULL)
+            goto fin;
+        istrue = PyObject_IsTrue(attr);
+        Py_DECREF(attr);
+        if (istrue == -1)
+            goto fin;
+        if (! istrue)
+            continue;
+
+        /* Count every hit when the breakpoint is enabled. */
+        attr = PyObject_GetAttrString(bp, "hits");
+        if (attr == NULL)
+            goto fin;
+        value = PyLong_AsLong(attr);
+        Py_DECREF(attr);
+        if (value == -1 && PyErr_Occurred())
+            goto fin;
+        attr = PyLong_FromLong(value + 1);
+        if (attr == NULL)
+            goto fin;
+        if (PyObject_SetAttrString(bp, "hits", attr) != 0) {
+            Py_DECREF(attr);
+            goto fin;
+        }
+        Py_DECREF(attr);
+
+        attr = PyObject_GetAttrString(bp, "cond");
+        if (attr == NULL)
+            goto fin;
+        istrue = PyObject_IsTrue(attr);
+        if (istrue == -1) {
+            Py_DECREF(attr);
+            goto fin;
+        }
+        if (istrue) {
+            PyObject *cond_code = get_cond_code(bp, attr);
+
+            Py_DECREF(attr);
+            if (cond_code == NULL)
+                goto fin;
+            if (cond_code == Py_None) {
+                /* The condition does not compile: the most conservative
+                 * thing is to stop on the breakpoint and not to delete a
+                 * temporary, as a hint to the user. */
+                cond_error = 1;
+            }
+            else {
+                PyObject *v;
+
+                if (f_locals == NULL) {
+                    PyFrame_FastToLocals(frame);
+                    f_locals = FRAME_LOCALS(frame);
+                }
+                v = PyEval_EvalCode(cond_code, FRAME_GLOBALS(frame), f_locals);
+                if (v == NULL) {
+                    PyErr_Clear();
+                    cond_error = 1;
+                }
+                else {
+                    istrue = PyObject_IsTrue(v);
+                    Py_DECREF(v);
+                    if (istrue == -1) {
+                        PyErr_Clear();
+                        cond_error = 1;
+                    }
+                    else if (! istrue)
+                        stop = 0;
+                }
+            }
+            Py_DECREF(cond_code);
+        }
+        else
+            Py_DECREF(attr);
+
+        if (! stop)
+            continue;
+
+        if (! cond_error) {
+            attr = PyObject_GetAttrString(bp, "ignore");
+            if (attr == NULL)
+                goto fin;
+            value = PyLong_AsLong(attr);
+            Py_DECREF(attr);
+            if (value == -1 && PyErr_Occurred())
+                goto fin;
+            if (value > 0) {
+                attr = PyLong_FromLong(value - 1);
+                if (attr == NULL)
+                    goto fin;
+                if (PyObject_SetAttrString(bp, "ignore", attr) != 0) {
+                    Py_DECREF(attr);
+                    goto fin;
+                }
+                Py_DECREF(attr);
+                continue;
+            }
+        }
+
+        number = PyObject_GetAttrString(bp, "number");
+        if (number == NULL)
+            goto fin;
+        if (PyList_Append(effective, number) != 0) {
+            Py_DECREF(number);
+            goto fin;
+        }
+
+        if (! cond_error) {
+            attr = PyObject_GetAttrString(bp, "temporary");
+            if (attr == NULL) {
+                Py_DECREF(number);
+                goto fin;
+            }
+            istrue = PyObject_IsTrue(attr);
+            Py_DECREF(attr);
+            if (istrue == -1 ||
+                    (istrue && PyList_Append(temporaries, number) != 0)) {
+                Py_DECREF(number);
+                goto fin;
+            }
+        }
+        Py_DECREF(number);
+    }
+
+    if (PyList_GET_SIZE(effective) == 0) {
+        Py_INCREF(Py_None);
+        result = Py_None;
+    }
+    else {
+        if (PyList_Sort(effective) != 0 || PyList_Sort(temporaries) != 0)
+            goto fin;
+        result = Py_BuildValue("(OO)", effective, temporaries);
+    }
+
+fin:
+    Py_XDECREF(effective);
+    Py_XDECREF(temporaries);
+    return result;
+}
+
 static PyObject *
 user_method(BdbTracer *self, PyFrameObject *frame, char *name, PyObject *arg)
 {
     PyObject *result;
     PyObject *tmp;
+    int lazy_locals;
 
     if (self->botframe == Py_None) {
         Py_INCREF(frame);
@@ -330,13 +1154,26 @@ user_method(BdbTracer *self, PyFrameObject *frame, char *name, PyObject *arg)
     self->topframe_locals = Py_None;
     Py_DECREF(tmp);
 
+    /* Materialize the frame locals lazily: the possibly stale f_locals
+     * cache of an optimized frame is dropped, so that frame_getlocals()
+     * builds an accurate dictionary on the first access made by the handler,
+     * and the copy back to the fast slots runs only when such an access took
+     * place. A print-and-continue breakpoint skips both copies, which are
+     * the dominant cost of automated breakpoints on frames with many locals
+     * or cells. */
+    lazy_locals = (FRAME_CODE(frame)->co_flags & CO_OPTIMIZED) != 0;
+    if (lazy_locals)
+        Py_CLEAR(FRAME_LOCALS(frame));
+    else
+        PyFrame_FastToLocals(frame);
+
     /* call the Python-level function */
-    PyFrame_FastToLocals(frame);
-    if (strcmp(name, "user_line") == 0)
+    if (arg == NULL)
         result = PyObject_CallMethod((PyObject *)self, name, "(O)", frame);
     else
         result = PyObject_CallMethod((PyObject *)self, name, "OO", frame, arg);
-    PyFrame_LocalsToFast(frame, 1);
+    if (! lazy_locals || FRAME_LOCALS(frame) != NULL)
+        PyFrame_LocalsToFast(frame, 1);
 
     if (result == NULL)
         return NULL;
@@ -361,6 +1198,7 @@ swap_tracer_profiler(BdbTracer *self)
 {
     PyObject *trace_obj = BdbTracer_gettrace(self);
     if (trace_obj != Py_None) {
+        self->swap_count++;
         PyEval_SetProfile(profiler, (PyObject *)self);
         PyEval_SetTrace(NULL, NULL);
     }
@@ -368,6 +1206,65 @@ swap_tracer_profiler(BdbTracer *self)
 }
 #endif
 
+#ifdef BDB_WATCHPOINTS
+/* Compare the fast locals slot of each watchpoint entry of 'frame' against
+ * the value recorded by the previous comparison. A store rebinds the slot,
+ * so an unchanged variable costs one pointer compare per opcode event.
+ * Return a list of (name, old value, new value) tuples when at least one
+ * slot changed, after updating the entries, Py_None otherwise. */
+static PyObject *
+check_watchpoints(BdbTracer *self, PyFrameObject *frame)
+{
+    PyObject *entries;
+    PyObject *changes = NULL;
+    Py_ssize_t i;
+
+    entries = PyDict_GetItem(self->watchpoints, (PyObject *)frame);
+    if (entries == NULL) {
+        /* The last watchpoint of this frame has been cleared. */
+        frame->f_trace_opcodes = 0;
+        Py_RETURN_NONE;
+    }
+    for (i = 0; i < PyList_GET_SIZE(entries); i++) {
+        PyObject *entry = PyList_GET_ITEM(entries, i);
+        Py_ssize_t index = PyLong_AsSsize_t(PyList_GET_ITEM(entry, 1));
+        PyObject *old = PyList_GET_ITEM(entry, 2);
+        PyObject *value = FRAME_LOCAL(frame, index);
+        PyObject *change;
+        int rc;
+
+        /* An unbound local compares as None, matching Bdb.set_watch(). */
+        if (value == NULL)
+            value = Py_None;
+        if (value == old)
+            continue;
+        if (changes == NULL) {
+            changes = PyList_New(0);
+            if (changes == NULL)
+                return NULL;
+        }
+        change = Py_BuildValue("(OOO)",
+                               PyList_GET_ITEM(entry, 0), old, value);
+        if (change == NULL)
+            goto fail;
+        rc = PyList_Append(changes, change);
+        Py_DECREF(change);
+        if (rc == -1)
+            goto fail;
+        Py_INCREF(value);
+        if (PyList_SetItem(entry, 2, value) == -1)
+            goto fail;
+    }
+    if (changes == NULL)
+        Py_RETURN_NONE;
+    return changes;
+
+fail:
+    Py_XDECREF(changes);
+    return NULL;
+}
+#endif
+
 static int
 tracer(PyObject *traceobj, PyFrameObject *frame, int what, PyObject *arg)
 {
@@ -394,6 +1291,7 @@ tracer(PyObject *traceobj, PyFrameObject *frame, int what, PyObject *arg)
 
     switch (what) {
         case PyTrace_LINE:
+            self->ev_line++;
             rc = stop_here(self, frame);
             if (rc == -1)
                 goto fail;
@@ -408,24 +1306,69 @@ tracer(PyObject *traceobj, PyFrameObject *frame, int what, PyObject *arg)
             else if (module_bps == Py_None)
                 Py_DECREF(Py_None);
             else {
-                result = user_method(self, frame, "bkpt_user_line", module_bps);
+                PyObject *hits;
+
                 Py_DECREF(module_bps);
-                goto fin;
+                hits = bkpt_effective(self, frame);
+                if (hits == NULL)
+                    goto fail;
+                else if (hits == Py_None)
+                    /* No breakpoint is effective at this line: a false
+                     * condition or a positive ignore count costs at most the
+                     * evaluation of a tiny code object. */
+                    Py_DECREF(hits);
+                else {
+                    result = user_method(self, frame, "user_line", hits);
+                    Py_DECREF(hits);
+                    goto fin;
+                }
             }
             break;
 
         case PyTrace_CALL:
+            self->ev_call++;
+            flight_record(self, FRAME_CODE(frame), what);
             result = trace_call(self, frame, arg);
             goto fin;
 
         case PyTrace_RETURN:
+            self->ev_return++;
+#ifdef BDB_WATCHPOINTS
+            /* The frame is going away with its watchpoints. */
+            if (PyDict_GET_SIZE(self->watchpoints) &&
+                    PyDict_GetItem(self->watchpoints,
+                                   (PyObject *)frame) != NULL) {
+                if (PyDict_DelItem(self->watchpoints,
+                                   (PyObject *)frame) == -1)
+                    goto fail;
+            }
+#endif
+            flight_record(self, FRAME_CODE(frame), what);
             result = trace_return(self, frame, arg);
             goto fin;
 
         case PyTrace_EXCEPTION:
+            self->ev_exception++;
             assert(PyTuple_Check(arg));
             assert(PyTuple_GET_SIZE(arg) == 3);
 
+            /* With no stepping active - the 'continue' state - stop_here()
+             * and the generator checks below cannot stop, so exceptions
+             * used as control flow by the debuggee cost at most two pointer
+             * compares. Only the exceptions matching the break_exceptions
+             * filter do any work. */
+            if (self->stopframe == Py_None && self->stop_lineno == -1) {
+                if (self->break_exceptions == Py_None)
+                    break;
+                rc = PyErr_GivenExceptionMatches(PyTuple_GET_ITEM(arg, 0),
+                                                 self->break_exceptions);
+                if (rc) {
+                    result = user_method(self, frame, "user_exception", arg);
+                    goto fin;
+                }
+                break;
+            }
+
             rc = stop_here(self, frame);
             if (rc == -1)
                 goto fail;
@@ -434,7 +1377,7 @@ tracer(PyObject *traceobj, PyFrameObject *frame, int what, PyObject *arg)
                  * skip the internal StopIteration exception (with no
                  * traceback) triggered by a subiterator run with the 'yield
                  * from' statement. */
-                if (! (frame->f_code->co_flags & CO_GENERATOR &&
+                if (! (FRAME_CODE(frame)->co_flags & CO_GENERATOR &&
                         PyTuple_GET_ITEM(arg, 0) == PyExc_StopIteration &&
                         PyTuple_GET_ITEM(arg, 2) == Py_None)) {
                     result = user_method(self, frame, "user_exception", arg);
@@ -448,7 +1391,7 @@ tracer(PyObject *traceobj, PyFrameObject *frame, int what, PyObject *arg)
             else if (self->stopframe != Py_None) {
                 stopframe = (PyFrameObject *)self->stopframe;
                 if (frame != stopframe &&
-                    stopframe->f_code->co_flags & CO_GENERATOR &&
+                    FRAME_CODE(stopframe)->co_flags & CO_GENERATOR &&
                     (PyTuple_GET_ITEM(arg, 0) == PyExc_StopIteration ||
                         PyTuple_GET_ITEM(arg, 0) == PyExc_GeneratorExit)) {
                     result = user_method(self, frame, "user_exception", arg);
@@ -457,6 +1400,23 @@ tracer(PyObject *traceobj, PyFrameObject *frame, int what, PyObject *arg)
             }
             break;
 
+#ifdef BDB_WATCHPOINTS
+        case PyTrace_OPCODE:
+            /* Only the frames where Bdb.set_watch() has enabled opcode
+             * tracing get these events. */
+            result = check_watchpoints(self, frame);
+            if (result == NULL)
+                goto fail;
+            else if (result == Py_None) {
+                Py_DECREF(result);
+                goto exit;
+            }
+            tmp = result;
+            result = user_method(self, frame, "user_watch", tmp);
+            Py_DECREF(tmp);
+            goto fin;
+#endif
+
         default:
             break;
     }
@@ -480,7 +1440,7 @@ fin:
          * which is when we are  re-entering a generator frame where the {next,
          * until, return} command had been previously issued. */
         if (what == PyTrace_CALL &&
-                ! (frame->f_code->co_flags & CO_GENERATOR
+                ! (FRAME_CODE(frame)->co_flags & CO_GENERATOR
                         && (PyObject *)frame == self->stopframe))
             swap_tracer_profiler(self);
 #endif
@@ -490,7 +1450,8 @@ exit:
 #ifdef TRACE_AND_PROFILE
     /* Returning to the calling frame where lines are not traced. */
     if (what == PyTrace_RETURN && (PyObject *)frame != self->botframe) {
-        if (frame->f_back != NULL && frame->f_back->f_trace == NULL)
+        PyFrameObject *f_back = frame_back(frame);
+        if (f_back != NULL && f_back->f_trace == NULL)
             swap_tracer_profiler(self);
     }
 #endif
@@ -517,8 +1478,10 @@ profiler(PyObject *traceobj, PyFrameObject *frame, int what, PyObject *arg)
 
     switch (what) {
         case PyTrace_CALL:
+            self->ev_call++;
+            flight_record(self, FRAME_CODE(frame), what);
             result = trace_call(self, frame, arg);
-            stop_in_gen = (frame->f_code->co_flags & CO_GENERATOR &&
+            stop_in_gen = (FRAME_CODE(frame)->co_flags & CO_GENERATOR &&
                                     (PyObject *)frame == self->stopframe);
             if (result == NULL) {
                 PyTraceBack_Here(frame);
@@ -538,6 +1501,7 @@ profiler(PyObject *traceobj, PyFrameObject *frame, int what, PyObject *arg)
                 frame->f_trace = NULL;
                 Py_XDECREF(tmp);
                 frame->f_trace = result;
+                self->swap_count++;
                 PyEval_SetTrace(tracer, (PyObject *)self);
                 PyEval_SetProfile(NULL, NULL);
             }
@@ -546,11 +1510,17 @@ profiler(PyObject *traceobj, PyFrameObject *frame, int what, PyObject *arg)
             break;
 
         case PyTrace_RETURN:
+            self->ev_return++;
+            flight_record(self, FRAME_CODE(frame), what);
             if ((PyObject *)frame == self->botframe)
                 PyEval_SetProfile(NULL, NULL);
-            else if (frame->f_back == NULL || frame->f_back->f_trace != NULL) {
-                PyEval_SetTrace(tracer, (PyObject *)self);
-                PyEval_SetProfile(NULL, NULL);
+            else {
+                PyFrameObject *f_back = frame_back(frame);
+                if (f_back == NULL || f_back->f_trace != NULL) {
+                    self->swap_count++;
+                    PyEval_SetTrace(tracer, (PyObject *)self);
+                    PyEval_SetProfile(NULL, NULL);
+                }
             }
             break;
 
@@ -569,7 +1539,6 @@ static PyObject *
 trace_call(BdbTracer *self, PyFrameObject *frame, PyObject *arg)
 {
     PyObject *result;
-    int lineno;
     int rc;
 
     if (self->ignore_first_call_event) {
@@ -578,10 +1547,7 @@ trace_call(BdbTracer *self, PyFrameObject *frame, PyObject *arg)
         return (PyObject *)self;
     }
 
-    rc = PySequence_Contains(self->skip_calls, (PyObject *)frame->f_code);
-    if (rc == -1)
-        return NULL;
-    else if (rc) {
+    if (in_skip_calls(self, FRAME_CODE(frame))) {
         Py_INCREF(Py_None);
         return Py_None;
     }
@@ -596,22 +1562,26 @@ trace_call(BdbTracer *self, PyFrameObject *frame, PyObject *arg)
         /* When frame is stopframe, we are  re-entering a generator
          frame where the {next, until, return} command had been previously
          issued, so we need to enable tracing in this function. */
-        if (frame->f_code->co_flags & CO_GENERATOR &&
+        if (FRAME_CODE(frame)->co_flags & CO_GENERATOR &&
                             (PyObject *)frame == self->stopframe) {
             Py_DECREF(result);
             Py_INCREF(self);
             return (PyObject *)self;
         }
+        /* With an exception filter armed the frame keeps its trace
+         * function, so that its PyTrace_EXCEPTION events are delivered. */
+        if (self->break_exceptions != Py_None) {
+            Py_DECREF(result);
+            Py_INCREF(self);
+            return (PyObject *)self;
+        }
         return result;
     }
     Py_DECREF(result);
 
     // Ignore call events in generator except when stepping.
-    lineno = PyLong_AsLong(self->stop_lineno);
-    if (lineno == -1 && PyErr_Occurred())
-        return NULL;
-    if (frame->f_code->co_flags & CO_GENERATOR &&
-            (self->stopframe != Py_None || lineno != 0)) {
+    if (FRAME_CODE(frame)->co_flags & CO_GENERATOR &&
+            (self->stopframe != Py_None || self->stop_lineno != 0)) {
         Py_INCREF(self);
         return (PyObject *)self;
     }
@@ -629,7 +1599,6 @@ trace_return(BdbTracer *self, PyFrameObject *frame, PyObject *arg)
     PyFrameObject *f_back;
     PyObject *result;
     PyObject *tmp;
-    int lineno;
     int rc;
     int ignore;
 
@@ -639,11 +1608,8 @@ trace_return(BdbTracer *self, PyFrameObject *frame, PyObject *arg)
     if (rc || (PyObject *)frame == self->stopframe) {
 
         // Ignore return events in generator except when stepping.
-        lineno = PyLong_AsLong(self->stop_lineno);
-        if (lineno == -1 && PyErr_Occurred())
-            return NULL;
-        ignore = (frame->f_code->co_flags & CO_GENERATOR &&
-                    (self->stopframe != Py_None || lineno != 0));
+        ignore = (FRAME_CODE(frame)->co_flags & CO_GENERATOR &&
+                    (self->stopframe != Py_None || self->stop_lineno != 0));
         if (! ignore) {
             result = user_method(self, frame, "user_return", arg);
             if (result == NULL)
@@ -653,13 +1619,10 @@ trace_return(BdbTracer *self, PyFrameObject *frame, PyObject *arg)
             Py_DECREF(result);
         }
 
-        lineno = PyLong_AsLong(self->stop_lineno);
-        if (lineno == -1 && PyErr_Occurred())
-            return NULL;
         if ((PyObject *)frame != self->botframe &&
-                ((self->stopframe == Py_None && lineno == 0) ||
+                ((self->stopframe == Py_None && self->stop_lineno == 0) ||
                 (PyObject *)frame == self->stopframe)) {
-            f_back = frame->f_back;
+            f_back = frame_back(frame);
             if (f_back != NULL && f_back->f_trace == NULL) {
                 Py_INCREF(self);
                 /* f_lineno must be accurate when f_trace is set. */
@@ -673,9 +1636,7 @@ trace_return(BdbTracer *self, PyFrameObject *frame, PyObject *arg)
                 self->stopframe = Py_None;
                 Py_DECREF(tmp);
 
-                tmp = self->stop_lineno;
-                self->stop_lineno = PyLong_FromLong(0L);
-                Py_DECREF(tmp);
+                self->stop_lineno = 0;
             }
 
         }
@@ -717,10 +1678,7 @@ BdbTracer_reset(BdbTracer *self, PyObject *args, PyObject *kwds)
     Py_INCREF(self->botframe);
     Py_XDECREF(tmp);
 
-    tmp = self->quitting;
-    Py_INCREF(Py_False);
-    self->quitting = Py_False;
-    Py_XDECREF(tmp);
+    self->quitting = 0;
 
     tmp = self->topframe;
     Py_INCREF(Py_None);
@@ -737,9 +1695,7 @@ BdbTracer_reset(BdbTracer *self, PyObject *args, PyObject *kwds)
     self->stopframe = Py_None;
     Py_XDECREF(tmp);
 
-    tmp = self->stop_lineno;
-    self->stop_lineno = PyLong_FromLong(0L);
-    Py_XDECREF(tmp);
+    self->stop_lineno = 0;
 
     Py_RETURN_NONE;
 }
@@ -787,6 +1743,88 @@ BdbTracer_settrace(BdbTracer *self, PyObject *args)
     return Py_None;
 }
 
+static void
+set_use_tracing(PyThreadState *p, int use)
+{
+#if PY_VERSION_HEX >= 0x030B0000
+    /* On 3.11 the eval loop or's the flag into each opcode, so it must be
+     * 0 or 255, see _PyThreadState_UpdateTracingState(). */
+    p->cframe->use_tracing = use ? 255 : 0;
+#elif PY_VERSION_HEX >= 0x030A0000
+    /* On 3.10 the authoritative flag lives in the thread CFrame. */
+    p->cframe->use_tracing = use;
+#else
+    p->use_tracing = use;
+#endif
+}
+
+static PyObject *
+BdbTracer_settrace_thread(BdbTracer *self, PyObject *args)
+{
+    unsigned long thread_id;
+    PyObject *do_set;
+    PyThreadState *tstate;
+    PyThreadState *p;
+    PyObject *temp;
+
+    if (! PyArg_ParseTuple(args, "kO!:settrace_thread", &thread_id,
+            &PyBool_Type, &do_set))
+        return NULL;
+
+    tstate = PyThreadState_GET();
+    for (p = PyInterpreterState_ThreadHead(tstate->interp); p != NULL;
+            p = PyThreadState_Next(p)) {
+        if (p->thread_id == thread_id)
+            break;
+    }
+    if (p == NULL) {
+        PyErr_Format(PyExc_ValueError,
+            "no Python thread with thread_id %lu", thread_id);
+        return NULL;
+    }
+
+    if (p == tstate) {
+        if (do_set == Py_True)
+            PyEval_SetTrace(tracer, (PyObject *)self);
+        else
+            PyEval_SetTrace(NULL, NULL);
+#ifdef TRACE_AND_PROFILE
+        PyEval_SetProfile(NULL, NULL);
+#endif
+        Py_RETURN_TRUE;
+    }
+
+    /* Mirror PyEval_SetTrace() on the target thread state. Holding the GIL
+     * guarantees that the target thread is not executing bytecode while its
+     * trace function is changed. The interpreter 'tracing possible' counter
+     * does not need to be incremented here as the thread arming the other
+     * threads is itself being traced. */
+#ifdef TRACE_AND_PROFILE
+    /* The tracer may currently be swapped in as the profiler of the target
+     * thread. */
+    if (p->c_profileobj == (PyObject *)self) {
+        temp = p->c_profileobj;
+        p->c_profilefunc = NULL;
+        p->c_profileobj = NULL;
+        Py_XDECREF(temp);
+    }
+#endif
+    temp = p->c_traceobj;
+    if (do_set == Py_True) {
+        Py_INCREF(self);
+        p->c_tracefunc = tracer;
+        p->c_traceobj = (PyObject *)self;
+        set_use_tracing(p, 1);
+    }
+    else {
+        p->c_tracefunc = NULL;
+        p->c_traceobj = NULL;
+        set_use_tracing(p, p->c_profilefunc != NULL);
+    }
+    Py_XDECREF(temp);
+    Py_RETURN_TRUE;
+}
+
 static PyObject *
 BdbTracer_gettrace(BdbTracer *self)
 {
@@ -806,6 +1844,108 @@ BdbTracer_gettrace(BdbTracer *self)
     return temp;
 }
 
+static PyObject *
+BdbTracer_bkpt_invalidate(BdbTracer *self)
+{
+    /* Invalidate the one-entry breakpoint cache and the line bitmap. They
+     * are rebuilt by bkpt_in_code at the next debug event. */
+    Py_CLEAR(self->f_code);
+#ifdef BDB_CO_EXTRA
+    /* The co_extra entries become stale and are released lazily, when
+     * overwritten or when their code object is deallocated. */
+    bkpt_generation++;
+    bkpt_cache_release(self->cur_cache);
+    self->cur_cache = NULL;
+    self->linebmap = NULL;
+    self->linebmap_size = 0;
+#else
+    if (self->linebmap != NULL) {
+        PyMem_Free(self->linebmap);
+        self->linebmap = NULL;
+        self->linebmap_size = 0;
+    }
+#endif
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+BdbTracer_stats(BdbTracer *self)
+{
+    return Py_BuildValue("{s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K}",
+        "line_events", self->ev_line,
+        "call_events", self->ev_call,
+        "return_events", self->ev_return,
+        "exception_events", self->ev_exception,
+        "tracer_profiler_swaps", self->swap_count,
+        "bkpt_cache_hits", self->bkpt_cache_hits,
+        "bkpt_cache_misses", self->bkpt_cache_misses,
+        "lcfilename_hits", self->lcfilename_hits,
+        "lcfilename_misses", self->lcfilename_misses);
+}
+
+static PyObject *
+BdbTracer_reset_stats(BdbTracer *self)
+{
+    reset_stats(self);
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+BdbTracer_set_flight_recorder(BdbTracer *self, PyObject *args)
+{
+    Py_ssize_t size;
+
+    if (! PyArg_ParseTuple(args, "n:set_flight_recorder", &size))
+        return NULL;
+    if (size < 0) {
+        PyErr_SetString(PyExc_ValueError,
+            "the flight recorder size must not be negative");
+        return NULL;
+    }
+
+    flight_free(self);
+    if (size != 0) {
+        self->flightrec = PyMem_Malloc(size * sizeof(flight_entry));
+        if (self->flightrec == NULL)
+            return PyErr_NoMemory();
+        memset(self->flightrec, 0, size * sizeof(flight_entry));
+        self->flightrec_size = size;
+    }
+    Py_RETURN_TRUE;
+}
+
+static PyObject *
+BdbTracer_flight_recorder(BdbTracer *self)
+{
+    PyObject *list;
+    PyObject *item;
+    flight_entry *entry;
+    Py_ssize_t i;
+    Py_ssize_t n;
+    Py_ssize_t start;
+
+    n = (self->flightrec_count < (unsigned long long)self->flightrec_size ?
+            (Py_ssize_t)self->flightrec_count : self->flightrec_size);
+    start = (self->flightrec_count > (unsigned long long)self->flightrec_size ?
+            self->flightrec_next : 0);
+    list = PyList_New(n);
+    if (list == NULL)
+        return NULL;
+    for (i = 0; i < n; i++) {
+        entry = self->flightrec + (start + i) % self->flightrec_size;
+        item = Py_BuildValue("(OOisd)", entry->code->co_filename,
+            entry->code->co_name, entry->code->co_firstlineno,
+            entry->event == PyTrace_CALL ? "call" : "return",
+            entry->timestamp);
+        if (item == NULL) {
+            Py_DECREF(list);
+            return NULL;
+        }
+        PyList_SET_ITEM(list, i, item);
+    }
+    return list;
+}
+
 static PyObject *
 BdbTracer_stop_tracing(BdbTracer *self) {
     Py_INCREF(Py_NotImplemented);
@@ -829,7 +1969,23 @@ static PyMethodDef BdbTracer_methods[] = {
     {"reset", (PyCFunction)BdbTracer_reset, METH_VARARGS | METH_KEYWORDS,
             NULL},
     {"stop_here", (PyCFunction)BdbTracer_stop_here, METH_VARARGS, NULL},
+    {"bkpt_invalidate", (PyCFunction)BdbTracer_bkpt_invalidate, METH_NOARGS,
+            PyDoc_STR("Invalidate the breakpoint lookup caches.")},
+    {"stats", (PyCFunction)BdbTracer_stats, METH_NOARGS,
+            PyDoc_STR("Return the tracer statistics as a dictionary.")},
+    {"reset_stats", (PyCFunction)BdbTracer_reset_stats, METH_NOARGS,
+            PyDoc_STR("Reset the tracer statistics.")},
+    {"set_flight_recorder", (PyCFunction)BdbTracer_set_flight_recorder,
+            METH_VARARGS,
+            PyDoc_STR("Enable the flight recorder with a ring buffer of"
+                      " 'size' events, or disable it when 'size' is zero.")},
+    {"flight_recorder", (PyCFunction)BdbTracer_flight_recorder, METH_NOARGS,
+            PyDoc_STR("Return the recorded events, oldest first, as a list"
+                      " of (filename, function, firstlineno, event,"
+                      " timestamp) tuples.")},
     {"settrace", (PyCFunction)BdbTracer_settrace, METH_VARARGS, NULL},
+    {"settrace_thread", (PyCFunction)BdbTracer_settrace_thread, METH_VARARGS,
+            PyDoc_STR("Set or remove the trace function of another thread.")},
     {"gettrace", (PyCFunction)BdbTracer_gettrace, METH_NOARGS, NULL},
     {"stop_tracing", (PyCFunction)BdbTracer_stop_tracing,
             METH_VARARGS | METH_KEYWORDS, PyDoc_STR("Method overriden.")},
@@ -883,6 +2039,23 @@ static PyTypeObject BdbTracer_Type = {
     0,                              /*tp_is_gc*/
 };
 
+static PyObject *
+bdb_lower_filename(PyObject *self, PyObject *args)
+{
+    PyObject *filename;
+
+    if (! PyArg_ParseTuple(args, "U:lower_filename", &filename))
+        return NULL;
+    return lcfilename_fold(filename);
+}
+
+static PyMethodDef bdb_methods[] = {
+    {"lower_filename", bdb_lower_filename, METH_VARARGS,
+            PyDoc_STR("Return the lower case form of a filename, cached in"
+                      " the process-wide filename table.")},
+    {NULL, NULL} /* sentinel */
+};
+
 PyDoc_STRVAR(module_doc, "The _bdb module.");
 
 static struct PyModuleDef _bdbmodule = {
@@ -890,7 +2063,7 @@ static struct PyModuleDef _bdbmodule = {
     "_bdb",
     module_doc,
     -1,
-    NULL, NULL, NULL, NULL, NULL
+    bdb_methods, NULL, NULL, NULL, NULL
 };
 
 /* Initialization function for the module (*must* be called PyInit__bdb). */
@@ -903,6 +2076,14 @@ PyInit__bdb(void)
     if (PyType_Ready(&BdbTracer_Type) < 0)
         return NULL;
 
+#ifdef BDB_CO_EXTRA
+    /* The index is requested once for the whole process; when no index is
+     * available the breakpoint lookups simply fall back to the dictionary
+     * path. */
+    if (co_extra_index == -1)
+        co_extra_index = _PyEval_RequestCodeExtraIndex(bkpt_cache_free);
+#endif
+
     m = PyModule_Create(&_bdbmodule);
     if (m == NULL)
         return NULL;
@@ -0,0 +1,1046 @@
+/* The C implementation of the Tracer class in the bdb module, built on the
+ * sys.monitoring API of PEP 669 for Python 3.12 and above. */
+
+#include "Python.h"
+#include "structmember.h"
+#include "frameobject.h"
+
+/* With the legacy PyEval_SetTrace() interface, the interpreter delivers a
+ * PyTrace_LINE event for every line executed in a traced frame, whether or
+ * not a breakpoint is set at that line. With sys.monitoring, the LINE
+ * callback returns sys.monitoring.DISABLE for the lines without a
+ * breakpoint and the interpreter stops delivering events for these lines
+ * entirely, until sys.monitoring.restart_events() is called. The events are
+ * restarted whenever the set of breakpoints changes or a user stop may have
+ * changed the stepping state.
+*/
+
+/* The sys.monitoring module and some of its attributes, set at module
+ * initialization. */
+static PyObject *monitoring;
+static PyObject *mon_disable;           /* sys.monitoring.DISABLE */
+static int tool_id;                     /* sys.monitoring.DEBUGGER_ID */
+static long ev_py_start;
+static long ev_py_return;
+static long ev_line;
+static long ev_raise;
+
+typedef struct {
+    PyObject_HEAD
+
+    /* Attributes */
+    PyObject *trace_dispatch;
+    PyObject *breakpoints;
+    PyObject *botframe;
+    PyObject *quitting;
+    PyObject *topframe;
+    PyObject *topframe_locals;
+    PyObject *stopframe;
+    PyObject *stop_lineno;
+    PyObject *skip_modules;
+    PyObject *skip_calls;
+    PyObject *linenumbers;
+    PyObject *break_exceptions;
+
+    /* Internals */
+    int ignore_first_call_event;
+    int armed;                  /* True when the monitoring events are set. */
+    PyObject *lcfilename_cache; /* Dictionary mapping a co_filename object
+                                 * to its co_filename.lower() object. */
+} BdbTracer;
+
+/* Forward declarations. */
+static PyObject * BdbTracer_gettrace(BdbTracer *);
+
+static PyMemberDef
+BdbTracer_members[] = {
+    {"trace_dispatch", T_OBJECT, offsetof(BdbTracer, trace_dispatch), 0,
+        PyDoc_STR("This is self, the trace object.")},
+    {"breakpoints", T_OBJECT, offsetof(BdbTracer, breakpoints), 0,
+        PyDoc_STR("A dictionary mapping filenames to a ModuleBreakpoints"
+                  " instances.")},
+    {"botframe", T_OBJECT, offsetof(BdbTracer, botframe), 0,
+        PyDoc_STR("The oldest frame.")},
+    {"quitting", T_OBJECT, offsetof(BdbTracer, quitting), 0,
+        PyDoc_STR("Quit the debugging session when True.")},
+    {"topframe", T_OBJECT, offsetof(BdbTracer, topframe), 0,
+        PyDoc_STR("The current frame.")},
+    {"topframe_locals", T_OBJECT, offsetof(BdbTracer, topframe_locals), 0,
+        PyDoc_STR("The f_locals dictionary.")},
+    {"stopframe", T_OBJECT, offsetof(BdbTracer, stopframe), 0, NULL},
+    {"stop_lineno", T_OBJECT, offsetof(BdbTracer, stop_lineno), 0, NULL},
+    {"skip_modules", T_OBJECT, offsetof(BdbTracer, skip_modules), 0, NULL},
+    {"skip_calls", T_OBJECT, offsetof(BdbTracer, skip_calls), 0, NULL},
+    {"linenumbers", T_OBJECT, offsetof(BdbTracer, linenumbers), 0, NULL},
+    {"break_exceptions", T_OBJECT, offsetof(BdbTracer, break_exceptions), 0,
+        PyDoc_STR("An exception class or tuple of exception classes that"
+                  " generate a user_exception event when raised while no"
+                  " stepping is active, None by default.")},
+    {NULL}
+};
+
+static int
+BdbTracer_init(BdbTracer *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"to_lowercase",
+                             "skip_modules", "skip_calls", NULL};
+    PyObject *lowercase;
+    PyObject *result;
+
+    self->breakpoints = NULL;
+    self->botframe = NULL;
+    self->quitting = NULL;
+    self->topframe = NULL;
+    self->topframe_locals = NULL;
+    self->stopframe = NULL;
+    self->stop_lineno = NULL;
+    self->skip_modules = NULL;
+    self->skip_calls = NULL;
+    self->linenumbers = NULL;
+    self->break_exceptions = NULL;
+    self->lcfilename_cache = NULL;
+    self->armed = 0;
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "O!|O!O!:init", kwlist,
+            &PyBool_Type, &lowercase,
+            &PyTuple_Type, &self->skip_modules,
+            &PyTuple_Type, &self->skip_calls))
+        return -1;
+
+    /* Use a borrowed reference to avoid a cycle. */
+    self->trace_dispatch = (PyObject *)self;
+
+    if (lowercase == Py_True) {
+        self->lcfilename_cache = PyDict_New();
+        if (self->lcfilename_cache == NULL)
+            goto fail;
+    }
+
+    if (self->skip_modules == NULL) {
+        self->skip_modules = Py_BuildValue("()");
+        if (self->skip_modules == NULL)
+            goto fail;
+    }
+    else
+        Py_INCREF(self->skip_modules);
+
+    if (self->skip_calls == NULL) {
+        self->skip_calls = Py_BuildValue("()");
+        if (self->skip_calls == NULL)
+            goto fail;
+    }
+    else
+        Py_INCREF(self->skip_calls);
+
+    self->breakpoints = PyDict_New();
+    if (self->breakpoints == NULL)
+        goto fail;
+
+    self->linenumbers = PyList_New(0);
+    if (self->linenumbers == NULL)
+        goto fail;
+
+    Py_INCREF(Py_None);
+    self->break_exceptions = Py_None;
+
+    result = PyObject_CallMethod((PyObject *)self, "reset", NULL);
+    if (result == NULL)
+        goto fail;
+    Py_DECREF(result);
+
+    return 0;
+
+fail:
+    Py_XDECREF(self->skip_modules);
+    Py_XDECREF(self->skip_calls);
+    Py_XDECREF(self->breakpoints);
+    Py_XDECREF(self->linenumbers);
+    Py_XDECREF(self->break_exceptions);
+    Py_XDECREF(self->lcfilename_cache);
+    return -1;
+}
+
+static void
+BdbTracer_dealloc(BdbTracer *self)
+{
+    Py_XDECREF(self->breakpoints);
+    Py_XDECREF(self->botframe);
+    Py_XDECREF(self->quitting);
+    Py_XDECREF(self->topframe);
+    Py_XDECREF(self->topframe_locals);
+    Py_XDECREF(self->stopframe);
+    Py_XDECREF(self->stop_lineno);
+    Py_XDECREF(self->skip_modules);
+    Py_XDECREF(self->skip_calls);
+    Py_XDECREF(self->linenumbers);
+    Py_XDECREF(self->break_exceptions);
+    Py_XDECREF(self->lcfilename_cache);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+/* True when a step, next, until or return command is active, i.e. when the
+ * events without a breakpoint may not be disabled. */
+static int
+is_stepping(BdbTracer *self)
+{
+    long lineno = PyLong_AsLong(self->stop_lineno);
+
+    if (lineno == -1 && PyErr_Occurred())
+        return -1;
+    return (self->stopframe != Py_None || lineno != -1);
+}
+
+static int
+stop_here(BdbTracer *self, PyFrameObject *frame)
+{
+    PyObject *result;
+    long lineno;
+
+    if (PyTuple_GET_SIZE(self->skip_modules)) {
+        result = PyObject_CallMethod((PyObject *)self, "is_skipped_module",
+                                     "(O)", frame);
+        if (result == NULL)
+            return -1;
+        if (PyObject_IsTrue(result)) {
+            Py_DECREF(result);
+            return 0;
+        }
+        Py_DECREF(result);
+    }
+
+    lineno = PyLong_AsLong(self->stop_lineno);
+    if (lineno == -1 && PyErr_Occurred())
+        return -1;
+
+    if ((PyObject *)frame == self->stopframe || self->stopframe == Py_None) {
+        if (lineno == -1)
+            return 0;
+        return PyFrame_GetLineNumber(frame) >= lineno;
+    }
+
+    return 0;
+}
+
+/* Return the module_bps dictionary when breakpoints are set in 'code', or
+ * Py_None. */
+static PyObject *
+bkpt_in_code(BdbTracer *self, PyCodeObject *code)
+{
+    PyObject *filename = code->co_filename;
+    PyObject *result = NULL;
+    PyObject *lc_filename = NULL;
+    PyObject *firstlineno;
+    PyObject *module_bps;
+
+    if (self->lcfilename_cache != NULL) {
+        lc_filename = PyDict_GetItem(self->lcfilename_cache, filename);
+        if (lc_filename == NULL) {
+            lc_filename = PyObject_CallMethod(filename, "lower", NULL);
+            if (lc_filename == NULL)
+                return NULL;
+            if (PyDict_SetItem(self->lcfilename_cache, filename, lc_filename)){
+                Py_DECREF(lc_filename);
+                return NULL;
+            }
+        }
+        else
+            Py_INCREF(lc_filename);
+        filename = lc_filename;
+    }
+
+    module_bps = PyDict_GetItem(self->breakpoints, filename);
+    if (module_bps != NULL && code->co_firstlineno <
+            PyList_GET_SIZE(self->linenumbers)) {
+        firstlineno = PyList_GET_ITEM(self->linenumbers, code->co_firstlineno);
+        if (firstlineno != Py_None &&
+                PyDict_GetItem(module_bps, firstlineno) != NULL) {
+            Py_INCREF(module_bps);
+            result = module_bps;
+            goto fin;
+        }
+    }
+
+    Py_INCREF(Py_None);
+    result = Py_None;
+
+fin:
+    Py_XDECREF(lc_filename);
+    return result;
+}
+
+/* Return the module_bps dictionary when a breakpoint is set at this line, or
+ * Py_None. */
+static PyObject *
+bkpt_at_line(BdbTracer *self, PyCodeObject *code, int f_lineno)
+{
+    PyObject *module_bps;
+    PyObject *code_bps = NULL;
+    PyObject *firstlineno;
+    PyObject *lineno;
+    int haskey;
+
+    module_bps = bkpt_in_code(self, code);
+    if (module_bps == NULL || module_bps == Py_None)
+        return module_bps;
+
+    if (code->co_firstlineno < PyList_GET_SIZE(self->linenumbers)) {
+        firstlineno = PyList_GET_ITEM(self->linenumbers, code->co_firstlineno);
+        if (firstlineno != Py_None)
+            code_bps = PyDict_GetItem(module_bps, firstlineno);
+    }
+    if (code_bps != NULL && f_lineno < PyList_GET_SIZE(self->linenumbers)) {
+        lineno = PyList_GET_ITEM(self->linenumbers, f_lineno);
+        if (lineno != Py_None) {
+            haskey = PyDict_Contains(code_bps, lineno);
+            if (haskey == -1) {
+                Py_DECREF(module_bps);
+                return NULL;
+            }
+            else if (haskey)
+                return module_bps;
+        }
+    }
+
+    Py_DECREF(module_bps);
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/* Call the Python-level user_* function and restart the disabled monitoring
+ * events, as the user may have changed the stepping state or the set of
+ * breakpoints. */
+static PyObject *
+user_method(BdbTracer *self, PyFrameObject *frame, char *name, PyObject *arg)
+{
+    PyObject *result;
+    PyObject *tmp;
+
+    if (self->botframe == Py_None) {
+        Py_INCREF(frame);
+        self->botframe = (PyObject *)frame;
+        Py_DECREF(Py_None);
+    }
+
+    tmp = self->topframe;
+    Py_INCREF(frame);
+    self->topframe = (PyObject *)frame;
+    Py_DECREF(tmp);
+
+    tmp = self->topframe_locals;
+    Py_INCREF(Py_None);
+    self->topframe_locals = Py_None;
+    Py_DECREF(tmp);
+
+    if (strcmp(name, "user_line") == 0)
+        result = PyObject_CallMethod((PyObject *)self, name, "(O)", frame);
+    else
+        result = PyObject_CallMethod((PyObject *)self, name, "OO", frame, arg);
+    if (result == NULL)
+        return NULL;
+    Py_DECREF(result);
+
+    tmp = self->topframe;
+    Py_INCREF(Py_None);
+    self->topframe = Py_None;
+    Py_DECREF(tmp);
+
+    tmp = self->topframe_locals;
+    Py_INCREF(Py_None);
+    self->topframe_locals = Py_None;
+    Py_DECREF(tmp);
+
+    if (self->armed) {
+        result = PyObject_CallMethod(monitoring, "restart_events", NULL);
+        if (result == NULL)
+            return NULL;
+        Py_DECREF(result);
+    }
+
+    result = PyObject_CallMethod((PyObject *)self, "get_traceobj", NULL);
+    if (result == NULL)
+        return NULL;
+    Py_DECREF(result);
+    Py_RETURN_NONE;
+}
+
+/* The sys.monitoring LINE callback. */
+static PyObject *
+BdbTracer_monitor_line(BdbTracer *self, PyObject *args)
+{
+    PyCodeObject *code;
+    int f_lineno;
+    PyFrameObject *frame;
+    PyObject *module_bps;
+    PyObject *result;
+    int stepping;
+    int rc;
+
+    if (! PyArg_ParseTuple(args, "O!i:_monitor_line",
+            &PyCode_Type, &code, &f_lineno))
+        return NULL;
+
+    stepping = is_stepping(self);
+    if (stepping == -1)
+        return NULL;
+    if (stepping) {
+        frame = PyEval_GetFrame();
+        if (frame != NULL) {
+            rc = stop_here(self, frame);
+            if (rc == -1)
+                return NULL;
+            else if (rc)
+                return user_method(self, frame, "user_line", NULL);
+        }
+    }
+
+    module_bps = bkpt_at_line(self, code, f_lineno);
+    if (module_bps == NULL)
+        return NULL;
+    if (module_bps != Py_None) {
+        frame = PyEval_GetFrame();
+        if (frame != NULL) {
+            result = user_method(self, frame, "bkpt_user_line", module_bps);
+            Py_DECREF(module_bps);
+            return result;
+        }
+    }
+    Py_DECREF(module_bps);
+
+    if (! stepping) {
+        /* No breakpoint at this line and not stepping: the interpreter
+         * stops delivering LINE events for this line. */
+        Py_INCREF(mon_disable);
+        return mon_disable;
+    }
+    Py_RETURN_NONE;
+}
+
+/* The sys.monitoring PY_START callback. */
+static PyObject *
+BdbTracer_monitor_start(BdbTracer *self, PyObject *args)
+{
+    PyCodeObject *code;
+    int offset;
+    PyFrameObject *frame;
+    PyObject *result;
+    int stepping;
+    int rc;
+
+    if (! PyArg_ParseTuple(args, "O!i:_monitor_start",
+            &PyCode_Type, &code, &offset))
+        return NULL;
+
+    if (self->ignore_first_call_event) {
+        self->ignore_first_call_event = 0;
+        Py_RETURN_NONE;
+    }
+
+    rc = PySequence_Contains(self->skip_calls, (PyObject *)code);
+    if (rc == -1)
+        return NULL;
+    else if (rc)
+        Py_RETURN_NONE;
+
+    stepping = is_stepping(self);
+    if (stepping == -1)
+        return NULL;
+    if (stepping) {
+        frame = PyEval_GetFrame();
+        if (frame != NULL) {
+            rc = stop_here(self, frame);
+            if (rc == -1)
+                return NULL;
+            else if (rc)
+                return user_method(self, frame, "user_call", Py_None);
+        }
+        Py_RETURN_NONE;
+    }
+
+    result = bkpt_in_code(self, code);
+    if (result == NULL)
+        return NULL;
+    else if (result == Py_None) {
+        /* No breakpoint in this code and not stepping. */
+        Py_DECREF(result);
+        Py_INCREF(mon_disable);
+        return mon_disable;
+    }
+    Py_DECREF(result);
+    Py_RETURN_NONE;
+}
+
+/* The sys.monitoring PY_RETURN callback. */
+static PyObject *
+BdbTracer_monitor_return(BdbTracer *self, PyObject *args)
+{
+    PyCodeObject *code;
+    int offset;
+    PyObject *retval;
+    PyFrameObject *frame;
+    PyObject *result;
+    PyObject *tmp;
+    int stepping;
+    int rc;
+
+    if (! PyArg_ParseTuple(args, "O!iO:_monitor_return",
+            &PyCode_Type, &code, &offset, &retval))
+        return NULL;
+
+    stepping = is_stepping(self);
+    if (stepping == -1)
+        return NULL;
+    if (! stepping) {
+        frame = PyEval_GetFrame();
+        if (frame != NULL && (PyObject *)frame == self->botframe) {
+            result = PyObject_CallMethod((PyObject *)self,
+                                         "stop_tracing", "(O)", frame);
+            if (result == NULL)
+                return NULL;
+            Py_DECREF(result);
+            Py_RETURN_NONE;
+        }
+        result = bkpt_in_code(self, code);
+        if (result == NULL)
+            return NULL;
+        else if (result == Py_None) {
+            Py_DECREF(result);
+            Py_INCREF(mon_disable);
+            return mon_disable;
+        }
+        Py_DECREF(result);
+        Py_RETURN_NONE;
+    }
+
+    frame = PyEval_GetFrame();
+    if (frame == NULL)
+        Py_RETURN_NONE;
+
+    rc = stop_here(self, frame);
+    if (rc == -1)
+        return NULL;
+    if (rc || (PyObject *)frame == self->stopframe) {
+        result = user_method(self, frame, "user_return", retval);
+        if (result == NULL)
+            return NULL;
+        Py_DECREF(result);
+
+        if ((PyObject *)frame != self->botframe &&
+                (self->stopframe == Py_None ||
+                    (PyObject *)frame == self->stopframe)) {
+            tmp = self->stopframe;
+            Py_INCREF(Py_None);
+            self->stopframe = Py_None;
+            Py_DECREF(tmp);
+
+            tmp = self->stop_lineno;
+            self->stop_lineno = PyLong_FromLong(0L);
+            Py_DECREF(tmp);
+        }
+    }
+
+    if ((PyObject *)frame == self->botframe) {
+        result = PyObject_CallMethod((PyObject *)self,
+                                     "stop_tracing", "(O)", frame);
+        if (result == NULL)
+            return NULL;
+        Py_DECREF(result);
+    }
+    Py_RETURN_NONE;
+}
+
+/* The sys.monitoring RAISE callback. */
+static PyObject *
+BdbTracer_monitor_raise(BdbTracer *self, PyObject *args)
+{
+    PyCodeObject *code;
+    int offset;
+    PyObject *exc;
+    PyFrameObject *frame;
+    PyObject *exc_info;
+    PyObject *traceback;
+    PyObject *result;
+    int stepping;
+    int rc;
+
+    if (! PyArg_ParseTuple(args, "O!iO:_monitor_raise",
+            &PyCode_Type, &code, &offset, &exc))
+        return NULL;
+
+    stepping = is_stepping(self);
+    if (stepping == -1)
+        return NULL;
+    if (! stepping) {
+        /* With no stepping active - the 'continue' state - only the
+         * exceptions matching the break_exceptions filter do any work. */
+        if (self->break_exceptions == Py_None)
+            Py_RETURN_NONE;
+        rc = PyErr_GivenExceptionMatches((PyObject *)Py_TYPE(exc),
+                                         self->break_exceptions);
+        if (! rc)
+            Py_RETURN_NONE;
+    }
+
+    frame = PyEval_GetFrame();
+    if (frame == NULL)
+        Py_RETURN_NONE;
+
+    if (stepping) {
+        rc = stop_here(self, frame);
+        if (rc == -1)
+            return NULL;
+        else if (! rc)
+            Py_RETURN_NONE;
+    }
+
+    traceback = PyObject_GetAttrString(exc, "__traceback__");
+    if (traceback == NULL)
+        return NULL;
+    exc_info = Py_BuildValue("(OOO)",
+                    (PyObject *)Py_TYPE(exc), exc, traceback);
+    Py_DECREF(traceback);
+    if (exc_info == NULL)
+        return NULL;
+    result = user_method(self, frame, "user_exception", exc_info);
+    Py_DECREF(exc_info);
+    return result;
+}
+
+static PyObject *
+BdbTracer_reset(BdbTracer *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"ignore_first_call_event", "botframe", NULL};
+    PyObject *ignore = NULL;
+    PyObject *botframe = NULL;
+    PyObject *tmp;
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "|O!O:reset", kwlist,
+            &PyBool_Type, &ignore, &botframe))
+        return NULL;
+
+    self->ignore_first_call_event = 1 ? ignore != Py_False : 0;
+
+    tmp = self->botframe;
+    if (botframe == NULL)
+        self->botframe = Py_None;
+    else
+        self->botframe = botframe;
+    Py_INCREF(self->botframe);
+    Py_XDECREF(tmp);
+
+    tmp = self->quitting;
+    Py_INCREF(Py_False);
+    self->quitting = Py_False;
+    Py_XDECREF(tmp);
+
+    tmp = self->topframe;
+    Py_INCREF(Py_None);
+    self->topframe = Py_None;
+    Py_XDECREF(tmp);
+
+    tmp = self->topframe_locals;
+    Py_INCREF(Py_None);
+    self->topframe_locals = Py_None;
+    Py_XDECREF(tmp);
+
+    tmp = self->stopframe;
+    Py_INCREF(Py_None);
+    self->stopframe = Py_None;
+    Py_XDECREF(tmp);
+
+    tmp = self->stop_lineno;
+    self->stop_lineno = PyLong_FromLong(0L);
+    Py_XDECREF(tmp);
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+BdbTracer_stop_here(BdbTracer *self, PyObject *args)
+{
+    PyFrameObject *frame;
+    int rc;
+
+    if (! PyArg_ParseTuple(args, "O!:stop_here", &PyFrame_Type, &frame))
+        return NULL;
+
+    rc = stop_here(self, frame);
+
+    if (rc == -1)
+        return NULL;
+    else if (rc)
+        Py_RETURN_TRUE;
+    Py_RETURN_FALSE;
+}
+
+/* Register or unregister one monitoring callback. */
+static int
+register_callback(BdbTracer *self, long event, const char *name)
+{
+    PyObject *callback;
+    PyObject *result;
+
+    if (name != NULL) {
+        callback = PyObject_GetAttrString((PyObject *)self, name);
+        if (callback == NULL)
+            return -1;
+    }
+    else {
+        Py_INCREF(Py_None);
+        callback = Py_None;
+    }
+    result = PyObject_CallMethod(monitoring, "register_callback", "ilO",
+                                 tool_id, event, callback);
+    Py_DECREF(callback);
+    if (result == NULL)
+        return -1;
+    Py_DECREF(result);
+    return 0;
+}
+
+static PyObject *
+BdbTracer_settrace(BdbTracer *self, PyObject *args)
+{
+    PyObject *do_set;
+    PyObject *result;
+
+    if (! PyArg_ParseTuple(args, "O!:settrace", &PyBool_Type, &do_set))
+        return NULL;
+
+    if (do_set == Py_True) {
+        if (! self->armed) {
+            result = PyObject_CallMethod(monitoring, "use_tool_id", "is",
+                                         tool_id, "pdb-clone");
+            if (result == NULL) {
+                PyObject *name;
+                int ours;
+
+                if (! PyErr_ExceptionMatches(PyExc_ValueError))
+                    return NULL;
+                /* The tool id is in use: registering the callbacks anyway
+                 * would silently disable the tool that owns it, so only a
+                 * stale registration made by pdb-clone itself may be taken
+                 * over. */
+                PyErr_Clear();
+                name = PyObject_CallMethod(monitoring, "get_tool", "i",
+                                           tool_id);
+                if (name == NULL)
+                    return NULL;
+                ours = (PyUnicode_Check(name) &&
+                        PyUnicode_CompareWithASCIIString(name,
+                                                         "pdb-clone") == 0);
+                if (! ours) {
+                    PyErr_Format(PyExc_ValueError,
+                        "the sys.monitoring DEBUGGER_ID tool id is in use"
+                        " by %R", name);
+                    Py_DECREF(name);
+                    return NULL;
+                }
+                Py_DECREF(name);
+            }
+            else
+                Py_DECREF(result);
+            if (register_callback(self, ev_line, "_monitor_line") == -1 ||
+                    register_callback(self, ev_py_start,
+                                      "_monitor_start") == -1 ||
+                    register_callback(self, ev_py_return,
+                                      "_monitor_return") == -1 ||
+                    register_callback(self, ev_raise, "_monitor_raise") == -1)
+                return NULL;
+        }
+        result = PyObject_CallMethod(monitoring, "set_events", "il", tool_id,
+                        ev_line | ev_py_start | ev_py_return | ev_raise);
+        if (result == NULL)
+            return NULL;
+        Py_DECREF(result);
+        if (! self->armed) {
+            self->armed = 1;
+        }
+        else {
+            result = PyObject_CallMethod(monitoring, "restart_events", NULL);
+            if (result == NULL)
+                return NULL;
+            Py_DECREF(result);
+        }
+    }
+    else if (self->armed) {
+        result = PyObject_CallMethod(monitoring, "set_events", "il",
+                                     tool_id, 0L);
+        if (result == NULL)
+            return NULL;
+        Py_DECREF(result);
+        register_callback(self, ev_line, NULL);
+        register_callback(self, ev_py_start, NULL);
+        register_callback(self, ev_py_return, NULL);
+        register_callback(self, ev_raise, NULL);
+        result = PyObject_CallMethod(monitoring, "free_tool_id", "i",
+                                     tool_id);
+        if (result == NULL)
+            PyErr_Clear();
+        else
+            Py_DECREF(result);
+        self->armed = 0;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject *
+BdbTracer_gettrace(BdbTracer *self)
+{
+    PyObject *temp;
+
+    if (self->armed)
+        temp = (PyObject *) self;
+    else
+        temp = Py_None;
+
+    Py_INCREF(temp);
+    return temp;
+}
+
+static PyObject *
+BdbTracer_bkpt_invalidate(BdbTracer *self)
+{
+    PyObject *result;
+
+    /* Re-enable the events disabled at locations that may now hold a
+     * breakpoint. */
+    if (self->armed) {
+        result = PyObject_CallMethod(monitoring, "restart_events", NULL);
+        if (result == NULL)
+            return NULL;
+        Py_DECREF(result);
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+BdbTracer_stop_tracing(BdbTracer *self) {
+    Py_INCREF(Py_NotImplemented);
+    return Py_NotImplemented;
+}
+
+static PyObject *
+BdbTracer_is_skipped_module(BdbTracer *self, PyObject *args)
+{
+    Py_INCREF(Py_NotImplemented);
+    return Py_NotImplemented;
+}
+
+static PyObject *
+BdbTracer_get_traceobj(BdbTracer *self) {
+    Py_INCREF(Py_NotImplemented);
+    return Py_NotImplemented;
+}
+
+/* The rest of the tracer contract shared with the pure Python Tracer and
+ * the legacy C tracer. These features are not implemented by the
+ * sys.monitoring backend; the stubs mirror the graceful no-ops of the pure
+ * Python Tracer so that the shared bdb.py code works unchanged. */
+
+static PyObject *
+BdbTracer_settrace_thread(BdbTracer *self, PyObject *args)
+{
+    unsigned long thread_id;
+    PyObject *do_set;
+
+    if (! PyArg_ParseTuple(args, "kO!:settrace_thread", &thread_id,
+            &PyBool_Type, &do_set))
+        return NULL;
+
+    /* The monitoring events are global to the interpreter, there is no
+     * per-thread trace function to set. */
+    Py_RETURN_FALSE;
+}
+
+static PyObject *
+BdbTracer_stats(BdbTracer *self)
+{
+    return PyDict_New();
+}
+
+static PyObject *
+BdbTracer_reset_stats(BdbTracer *self)
+{
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+BdbTracer_set_flight_recorder(BdbTracer *self, PyObject *args)
+{
+    Py_ssize_t size;
+
+    if (! PyArg_ParseTuple(args, "n:set_flight_recorder", &size))
+        return NULL;
+    Py_RETURN_FALSE;
+}
+
+static PyObject *
+BdbTracer_flight_recorder(BdbTracer *self)
+{
+    return PyList_New(0);
+}
+
+static PyMethodDef BdbTracer_methods[] = {
+    {"reset", (PyCFunction)BdbTracer_reset, METH_VARARGS | METH_KEYWORDS,
+            NULL},
+    {"stop_here", (PyCFunction)BdbTracer_stop_here, METH_VARARGS, NULL},
+    {"bkpt_invalidate", (PyCFunction)BdbTracer_bkpt_invalidate, METH_NOARGS,
+            PyDoc_STR("Invalidate the breakpoint lookup caches.")},
+    {"stats", (PyCFunction)BdbTracer_stats, METH_NOARGS,
+            PyDoc_STR("Return the tracer statistics as a dictionary.")},
+    {"reset_stats", (PyCFunction)BdbTracer_reset_stats, METH_NOARGS,
+            PyDoc_STR("Reset the tracer statistics.")},
+    {"set_flight_recorder", (PyCFunction)BdbTracer_set_flight_recorder,
+            METH_VARARGS,
+            PyDoc_STR("Enable the flight recorder with a ring buffer of"
+                      " 'size' events, or disable it when 'size' is zero.")},
+    {"flight_recorder", (PyCFunction)BdbTracer_flight_recorder, METH_NOARGS,
+            PyDoc_STR("Return the recorded events, oldest first, as a list"
+                      " of (filename, function, firstlineno, event,"
+                      " timestamp) tuples.")},
+    {"settrace", (PyCFunction)BdbTracer_settrace, METH_VARARGS, NULL},
+    {"settrace_thread", (PyCFunction)BdbTracer_settrace_thread, METH_VARARGS,
+            PyDoc_STR("Set or remove the trace function of another thread.")},
+    {"gettrace", (PyCFunction)BdbTracer_gettrace, METH_NOARGS, NULL},
+    {"_monitor_line", (PyCFunction)BdbTracer_monitor_line, METH_VARARGS,
+            NULL},
+    {"_monitor_start", (PyCFunction)BdbTracer_monitor_start, METH_VARARGS,
+            NULL},
+    {"_monitor_return", (PyCFunction)BdbTracer_monitor_return, METH_VARARGS,
+            NULL},
+    {"_monitor_raise", (PyCFunction)BdbTracer_monitor_raise, METH_VARARGS,
+            NULL},
+    {"stop_tracing", (PyCFunction)BdbTracer_stop_tracing,
+            METH_VARARGS | METH_KEYWORDS, PyDoc_STR("Method overriden.")},
+    {"is_skipped_module", (PyCFunction)BdbTracer_is_skipped_module,
+            METH_VARARGS, PyDoc_STR("Method overriden by Bdb.")},
+    {"get_traceobj", (PyCFunction)BdbTracer_get_traceobj, METH_NOARGS,
+            PyDoc_STR("Method overriden by Bdb.")},
+    {NULL, NULL} /* sentinel */
+};
+
+static PyTypeObject BdbTracer_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "_bdb.BdbTracer",               /*tp_name*/
+    sizeof(BdbTracer),              /*tp_basicsize*/
+    0,                              /*tp_itemsize*/
+    (destructor)BdbTracer_dealloc,  /*tp_dealloc*/
+    0,                              /*tp_vectorcall_offset*/
+    0,                              /*tp_getattr*/
+    0,                              /*tp_setattr*/
+    0,                              /*tp_as_async*/
+    0,                              /*tp_repr*/
+    0,                              /*tp_as_number*/
+    0,                              /*tp_as_sequence*/
+    0,                              /*tp_as_mapping*/
+    0,                              /*tp_hash*/
+    0,                              /*tp_call*/
+    0,                              /*tp_str*/
+    0,                              /*tp_getattro*/
+    0,                              /*tp_setattro*/
+    0,                              /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /*tp_flags*/
+    "The C bdb tracer built on sys.monitoring.", /*tp_doc*/
+    0,                              /*tp_traverse*/
+    0,                              /*tp_clear*/
+    0,                              /*tp_richcompare*/
+    0,                              /*tp_weaklistoffset*/
+    0,                              /*tp_iter*/
+    0,                              /*tp_iternext*/
+    BdbTracer_methods,              /*tp_methods*/
+    BdbTracer_members,              /*tp_members*/
+    0,                              /*tp_getset*/
+    0,                              /*tp_base*/
+    0,                              /*tp_dict*/
+    0,                              /*tp_descr_get*/
+    0,                              /*tp_descr_set*/
+    0,                              /*tp_dictoffset*/
+    (initproc)BdbTracer_init,       /*tp_init*/
+    0,                              /*tp_alloc*/
+    0,                              /*tp_new*/
+    0,                              /*tp_free*/
+    0,                              /*tp_is_gc*/
+};
+
+PyDoc_STRVAR(module_doc, "The _bdb module.");
+
+static struct PyModuleDef _bdbmodule = {
+    PyModuleDef_HEAD_INIT,
+    "_bdb",
+    module_doc,
+    -1,
+    NULL, NULL, NULL, NULL, NULL
+};
+
+/* Fetch an event mask from sys.monitoring.events. */
+static int
+get_event(PyObject *events, const char *name, long *event)
+{
+    PyObject *value = PyObject_GetAttrString(events, name);
+
+    if (value == NULL)
+        return -1;
+    *event = PyLong_AsLong(value);
+    Py_DECREF(value);
+    if (*event == -1 && PyErr_Occurred())
+        return -1;
+    return 0;
+}
+
+/* Initialization function for the module (*must* be called PyInit__bdb). */
+PyMODINIT_FUNC
+PyInit__bdb(void)
+{
+    PyObject *m = NULL;
+    PyObject *sys;
+    PyObject *events;
+    PyObject *value;
+
+    /* sys.monitoring is an attribute of the sys module, not a submodule
+     * that can be imported by name. */
+    sys = PyImport_ImportModule("sys");
+    if (sys == NULL)
+        return NULL;
+    monitoring = PyObject_GetAttrString(sys, "monitoring");
+    Py_DECREF(sys);
+    if (monitoring == NULL)
+        return NULL;
+
+    mon_disable = PyObject_GetAttrString(monitoring, "DISABLE");
+    if (mon_disable == NULL)
+        return NULL;
+
+    value = PyObject_GetAttrString(monitoring, "DEBUGGER_ID");
+    if (value == NULL)
+        return NULL;
+    tool_id = (int)PyLong_AsLong(value);
+    Py_DECREF(value);
+    if (tool_id == -1 && PyErr_Occurred())
+        return NULL;
+
+    events = PyObject_GetAttrString(monitoring, "events");
+    if (events == NULL)
+        return NULL;
+    if (get_event(events, "PY_START", &ev_py_start) == -1 ||
+            get_event(events, "PY_RETURN", &ev_py_return) == -1 ||
+            get_event(events, "LINE", &ev_line) == -1 ||
+            get_event(events, "RAISE", &ev_raise) == -1) {
+        Py_DECREF(events);
+        return NULL;
+    }
+    Py_DECREF(events);
+
+    BdbTracer_Type.tp_new = PyType_GenericNew;
+    if (PyType_Ready(&BdbTracer_Type) < 0)
+        return NULL;
+
+    m = PyModule_Create(&_bdbmodule);
+    if (m == NULL)
+        return NULL;
+
+    Py_INCREF(&BdbTracer_Type);
+    PyModule_AddObject(m, "BdbTracer", (PyObject *)&BdbTracer_Type);
+    return m;
+}
@@ -26,11 +26,20 @@ typedef PyOS_sighandler_t _Py_sighandler_t;
 
 typedef struct {
     int signum;
+    int action;
     PyObject *address;
     _Py_sighandler_t previous;
 } pdbhandler_signal_t;
 
-static pdbhandler_signal_t pdbhandler_signal;
+/* The registered handlers, one slot per signal so that several signals can
+ * be registered, each with its own action. */
+#define PDBHANDLER_NSLOTS 8
+
+/* The handler actions. */
+#define PDBHANDLER_ATTACH 0     /* Start a remote debugging session. */
+#define PDBHANDLER_DUMP 1       /* Print the traceback of all threads. */
+
+static pdbhandler_signal_t pdbhandler_signals[PDBHANDLER_NSLOTS];
 #endif
 
 /* A dummy object that ends the pdb's subinterpreter when deallocated. */
@@ -45,6 +54,26 @@ typedef struct {
  * pdb.RemoteSocket. */
 static pdbtracerctxobject *current_pdbctx = NULL;
 
+/* The subinterpreter parked by the previous detach. Creating a
+ * subinterpreter and importing pdb on every handled signal takes noticeable
+ * wall time on processes with many modules, all of it with the GIL held. The
+ * subinterpreter is created lazily once and parked between attaches, so that
+ * the next attach only swaps thread states and accepts the socket, the
+ * import work having been done at the first attach. */
+static PyThreadState *parked_substate = NULL;
+
+static void
+end_parked_substate(void)
+{
+    if (parked_substate != NULL) {
+        PyThreadState *tstate = PyThreadState_GET();
+        PyThreadState_Swap(parked_substate);
+        Py_EndInterpreter(parked_substate);
+        parked_substate = NULL;
+        PyThreadState_Swap(tstate);
+    }
+}
+
 /* Forward declarations. */
 static void pdbtracerctx_dealloc(pdbtracerctxobject *);
 
@@ -138,7 +167,13 @@ bootstrappdb(void *args)
         return -1;
 
     PyThreadState_Swap(NULL);
-    if ((substate=Py_NewInterpreter()) == NULL) {
+    if (parked_substate != NULL) {
+        /* Reuse the parked subinterpreter, pdb is already imported there. */
+        substate = parked_substate;
+        parked_substate = NULL;
+        PyThreadState_Swap(substate);
+    }
+    else if ((substate=Py_NewInterpreter()) == NULL) {
         PyThreadState_Swap(mainstate);
         PyErr_SetString(PyExc_RuntimeError,
                         "pdb subinterpreter creation failed");
@@ -265,10 +300,17 @@ static void
 pdbtracerctx_dealloc(pdbtracerctxobject *self)
 {
     if (self->substate != NULL) {
-        PyThreadState *substate = PyThreadState_GET();
-        PyThreadState_Swap(self->substate);
-        Py_EndInterpreter(self->substate);
-        PyThreadState_Swap(substate);
+        if (parked_substate == NULL)
+            /* Park the subinterpreter for the next attach instead of paying
+             * the import work again. It is ended by unregister(), that
+             * atexit_register() arranged to run at exit. */
+            parked_substate = self->substate;
+        else {
+            PyThreadState *substate = PyThreadState_GET();
+            PyThreadState_Swap(self->substate);
+            Py_EndInterpreter(self->substate);
+            PyThreadState_Swap(substate);
+        }
         self->substate = NULL;
     }
     Py_TYPE(self)->tp_free((PyObject*)self);
@@ -277,16 +319,53 @@ pdbtracerctx_dealloc(pdbtracerctxobject *self)
 
 /* Windows does not have signal processing. */
 #ifndef MS_WINDOWS
-static void
-_pdbhandler(int signum)
+/* Print the traceback of all the threads with faulthandler. Like
+ * bootstrappdb(), this runs as a pending call at the next safe eval point,
+ * not in signal context. Failures are cleared silently, a diagnostic action
+ * must not raise in the interrupted program. */
+static int
+dumpstacks(void *args)
 {
-    pdbhandler_signal_t *psignal = &pdbhandler_signal;
+    PyObject *faulthandler;
+    PyObject *rv;
 
-    if (psignal->signum != signum)
-        return;
+    if (!Py_IsInitialized())
+        return 0;
+    faulthandler = PyImport_ImportModule("faulthandler");
+    if (faulthandler == NULL) {
+        PyErr_Clear();
+        return 0;
+    }
+    rv = PyObject_CallMethod(faulthandler, "dump_traceback", NULL);
+    Py_DECREF(faulthandler);
+    if (rv == NULL)
+        PyErr_Clear();
+    else
+        Py_DECREF(rv);
+    return 0;
+}
 
-    /* Silently ignore a full queue condition or a lock race condition. */
-    Py_AddPendingCall(bootstrappdb, (void *)psignal->address);
+static void
+_pdbhandler(int signum)
+{
+    int i;
+
+    /* Only plain loads and Py_AddPendingCall() here, which is
+     * async-signal-safe: the interrupted thread resumes immediately and the
+     * heavy work runs at the next safe eval point. */
+    for (i = 0; i < PDBHANDLER_NSLOTS; i++) {
+        pdbhandler_signal_t *psignal = &pdbhandler_signals[i];
+
+        if (psignal->signum != signum)
+            continue;
+        /* Silently ignore a full queue condition or a lock race
+         * condition. */
+        if (psignal->action == PDBHANDLER_DUMP)
+            Py_AddPendingCall(dumpstacks, (void *)psignal->address);
+        else
+            Py_AddPendingCall(bootstrappdb, (void *)psignal->address);
+        break;
+    }
 }
 
 static int
@@ -346,19 +425,57 @@ _unregister(pdbhandler_signal_t *psignal)
     (void)signal(psignal->signum, psignal->previous);
 #endif
     psignal->signum = 0;
+    psignal->action = 0;
     Py_CLEAR(psignal->address);
 }
 
+static void
+_unregister_all(void)
+{
+    int i;
+
+    end_parked_substate();
+    for (i = 0; i < PDBHANDLER_NSLOTS; i++)
+        _unregister(&pdbhandler_signals[i]);
+}
+
 static int
-_register(pdbhandler_signal_t *psignal, PyObject *host, int port, int signum)
+_register(PyObject *host, int port, int signum, int action)
 {
+    pdbhandler_signal_t *psignal = NULL;
     PyObject *address;
     PyObject *host_bytes = NULL;
     PyObject *port_obj = NULL;
     int rc = -1;
+    int i;
 
     if (!check_signum(&signum))
         return -1;
+    if (action != PDBHANDLER_ATTACH && action != PDBHANDLER_DUMP) {
+        PyErr_SetString(PyExc_ValueError, "unknown pdbhandler action");
+        return -1;
+    }
+
+    /* Reuse the slot already holding this signal, else take a free one. */
+    for (i = 0; i < PDBHANDLER_NSLOTS; i++) {
+        if (pdbhandler_signals[i].signum == signum) {
+            psignal = &pdbhandler_signals[i];
+            break;
+        }
+    }
+    if (psignal == NULL) {
+        for (i = 0; i < PDBHANDLER_NSLOTS; i++) {
+            if (pdbhandler_signals[i].signum == 0) {
+                psignal = &pdbhandler_signals[i];
+                break;
+            }
+        }
+    }
+    if (psignal == NULL) {
+        PyErr_SetString(PyExc_ValueError,
+                        "all the pdbhandler signal slots are in use");
+        return -1;
+    }
 
     /* Build the address dict. */
     if ((address=PyDict_New()) == NULL)
@@ -382,9 +499,6 @@ _register(pdbhandler_signal_t *psignal, PyObject *host, int port, int signum)
             goto err;
     }
 
-    if (psignal->signum != 0 && psignal->signum != signum)
-        _unregister(psignal);
-
     if (psignal->signum == 0) {
         int err;
         _Py_sighandler_t previous;
@@ -407,6 +521,7 @@ _register(pdbhandler_signal_t *psignal, PyObject *host, int port, int signum)
         psignal->previous = previous;
     }
 
+    psignal->action = action;
     Py_XDECREF(psignal->address);
     Py_INCREF(address);
     psignal->address = address;
@@ -422,36 +537,61 @@ err:
 static PyObject*
 _pdbhandler_register(PyObject *self, PyObject *args, PyObject *kwargs)
 {
-    static char *kwlist[] = {"host", "port", "signum", NULL};
+    static char *kwlist[] = {"host", "port", "signum", "action", NULL};
     int signum = 0;
     PyObject *host = NULL;
     int port = 0;
+    int action = PDBHANDLER_ATTACH;
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs,
-            "|O!ii:register", kwlist, &PyUnicode_Type, &host, &port, &signum))
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|O!iii:register", kwlist,
+            &PyUnicode_Type, &host, &port, &signum, &action))
         return NULL;
-    if (_register(&pdbhandler_signal, host, port, signum) == -1)
+    if (_register(host, port, signum, action) == -1)
         return NULL;
     Py_RETURN_NONE;
 }
 
 static PyObject*
-_pdbhandler_unregister(PyObject *self)
+_pdbhandler_unregister(PyObject *self, PyObject *args)
 {
-    _unregister(&pdbhandler_signal);
+    int signum = 0;
+    int i;
+
+    if (!PyArg_ParseTuple(args, "|i:unregister", &signum))
+        return NULL;
+    if (signum == 0)
+        _unregister_all();
+    else {
+        for (i = 0; i < PDBHANDLER_NSLOTS; i++) {
+            if (pdbhandler_signals[i].signum == signum)
+                _unregister(&pdbhandler_signals[i]);
+        }
+    }
     Py_RETURN_NONE;
 }
 
 static PyObject*
-_pdbhandler_registered(PyObject *self)
+_pdbhandler_registered(PyObject *self, PyObject *args)
 {
     PyObject *rv;
-    pdbhandler_signal_t *psignal = &pdbhandler_signal;
+    pdbhandler_signal_t *psignal = NULL;
     PyObject *host = NULL;
     PyObject *port = NULL;
+    int signum = 0;
     int port_0 = 0;
+    int i;
 
-    if (psignal->address) {
+    if (!PyArg_ParseTuple(args, "|i:registered", &signum))
+        return NULL;
+    /* With no argument, report the first registered slot. */
+    for (i = 0; i < PDBHANDLER_NSLOTS; i++) {
+        if (pdbhandler_signals[i].signum != 0 &&
+                (signum == 0 || pdbhandler_signals[i].signum == signum)) {
+            psignal = &pdbhandler_signals[i];
+            break;
+        }
+    }
+    if (psignal && psignal->address) {
         host = PyDict_GetItemString(psignal->address, "host");
         port = PyDict_GetItemString(psignal->address, "port");
     }
@@ -459,8 +599,9 @@ _pdbhandler_registered(PyObject *self)
         port_0 = 1;
         port = PyLong_FromLong(0);
     }
-    rv = Py_BuildValue("(OOi)", host == NULL ? Py_None: host, port,
-                       psignal->signum);
+    rv = Py_BuildValue("(OOii)", host == NULL ? Py_None: host, port,
+                       psignal ? psignal->signum : 0,
+                       psignal ? psignal->action : 0);
     if (port_0)
         Py_DECREF(port);
     return rv;
@@ -469,8 +610,8 @@ _pdbhandler_registered(PyObject *self)
 static PyMethodDef _pdbhandler_methods[] = {
     {"_register",
      (PyCFunction)_pdbhandler_register, METH_VARARGS|METH_KEYWORDS, NULL},
-    {"_unregister", (PyCFunction)_pdbhandler_unregister, METH_NOARGS, NULL},
-    {"_registered", (PyCFunction)_pdbhandler_registered, METH_NOARGS, NULL},
+    {"_unregister", (PyCFunction)_pdbhandler_unregister, METH_VARARGS, NULL},
+    {"_registered", (PyCFunction)_pdbhandler_registered, METH_VARARGS, NULL},
     {NULL, NULL, 0, NULL}        /* Sentinel */
 };
 #endif
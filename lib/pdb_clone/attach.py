@@ -23,12 +23,15 @@ except ImportError:
 import sys
 import os
 import io
+import re
 import cmd
+import json
 import argparse
 import signal
 import time
 import random
 import socket
+import struct
 import asyncore
 import asynchat
 import errno
@@ -52,6 +55,16 @@ class AttachSocket(asynchat.async_chat, cmd.Cmd):
         self.set_terminator(None)
         self.allow_kbdint = False
         self.data = b''
+        # The raw incoming bytes, possibly holding an incomplete frame, and
+        # whether the remote speaks the framed protocol (None until the first
+        # bytes have been received, see pdb.FRAME_MAGIC).
+        self.inbuf = b''
+        self.framed = None
+        # The context bundle pushed with the last prompt, see
+        # pdb.CONTEXT_MAGIC, and the count of response frames to drop, those
+        # of the commands already served from the bundle.
+        self.context = {}
+        self._drop_frames = 0
         self.remote = ''
         self.pid = 0
         self._previous_sigint_handler = None
@@ -88,6 +101,9 @@ class AttachSocket(asynchat.async_chat, cmd.Cmd):
         if self.connected:
             if self._previous_sigint_handler:
                 signal.signal(signal.SIGINT, self._previous_sigint_handler)
+            if self.inbuf and not self.framed:
+                self.data += self.inbuf
+                self.inbuf = b''
             content = _decode(self.data, encoding='utf-8')
             if content:
                 self.message(content.rstrip('\n'))
@@ -95,6 +111,56 @@ class AttachSocket(asynchat.async_chat, cmd.Cmd):
             self.close()
 
     def collect_incoming_data(self, data):
+        self.inbuf += data
+        if self.framed is None:
+            if len(self.inbuf) < len(pdb.FRAME_MAGIC):
+                return
+            self.framed = self.inbuf.startswith(pdb.FRAME_MAGIC)
+        if not self.framed:
+            # A remote debugger from a previous pdb-clone release, fall back
+            # to processing the raw stream.
+            data, self.inbuf = self.inbuf, b''
+            self.process_incoming_data(data)
+            return
+        # Reassemble the length-prefixed frames, each frame holds the full
+        # output of one pdb command up to and including the next prompt.
+        while len(self.inbuf) >= pdb.FRAME_HEADER_SIZE:
+            if not self.inbuf.startswith(pdb.FRAME_MAGIC):
+                self.message('Invalid frame received from the remote pdb,'
+                                            ' closing the connection.')
+                self.handle_close()
+                return
+            length = struct.unpack('>I',
+                    self.inbuf[len(pdb.FRAME_MAGIC):pdb.FRAME_HEADER_SIZE])[0]
+            if len(self.inbuf) < pdb.FRAME_HEADER_SIZE + length:
+                return
+            payload = self.inbuf[
+                        pdb.FRAME_HEADER_SIZE:pdb.FRAME_HEADER_SIZE + length]
+            self.inbuf = self.inbuf[pdb.FRAME_HEADER_SIZE + length:]
+            payload = self.extract_context(payload)
+            if self._drop_frames:
+                # The response of a command that has already been served
+                # from the context bundle, see _serve_context().
+                self._drop_frames -= 1
+                continue
+            self.process_incoming_data(payload)
+
+    def extract_context(self, payload):
+        """Strip and cache the context bundle pushed by the remote pdb."""
+        self.context = {}
+        magic = _encode(pdb.CONTEXT_MAGIC, encoding='utf-8')
+        if payload.startswith(magic):
+            idx = payload.find(b'\n')
+            if idx != -1:
+                try:
+                    self.context = json.loads(_decode(
+                        payload[len(magic):idx], encoding='utf-8'))
+                except ValueError:
+                    self.context = {}
+                payload = payload[idx + 1:]
+        return payload
+
+    def process_incoming_data(self, data):
         self.data += data
         while self.data and not self.remote:
             idx = self.data.find(b'\n')
@@ -197,6 +263,31 @@ class AttachSocket(asynchat.async_chat, cmd.Cmd):
             exec('def %s(self, l): return self.default(l, cmd="help %s")'
                                                     % (name, name[5:]))
 
+    def _serve_context(self, line, key):
+        # Serve the command from the context bundle pushed with the last
+        # prompt: the output is printed without a round trip and a copy of
+        # the command is still pipelined to the remote debugger, so that its
+        # state advances identically; the response frame is dropped on
+        # arrival. Fall back to a plain round trip when the bundle does not
+        # apply.
+        if (line.strip() or self.prompt != prompts[0] or
+                key not in self.context):
+            return self.default(line)
+        output = self.context.pop(key)
+        self._drop_frames += 1
+        self.push(_encode(self.curline, encoding='utf-8'))
+        self.message(output, end='', flush=True)
+        # Stay in cmdloop, the prompt is printed again locally.
+        return None
+
+    def do_where(self, line):
+        return self._serve_context(line, 'where')
+    do_w = do_bt = do_where
+
+    def do_list(self, line):
+        return self._serve_context(line, 'list')
+    do_l = do_list
+
 class AttachSocketWithDetach(AttachSocket):
     """A socket connected to a remote Pdb instance.
 
@@ -271,6 +362,13 @@ class Context:
         self.result = Result()
         self.stmt= StatementLine()
 
+# Precompiled gdb/MI output patterns, see found_terminator(). Compiling them
+# once matters on big binaries where an attach produces a lot of MI chatter.
+_mi_curline = re.compile(r'^~"(->.*?)(?:\\n)?"$')
+_mi_error = re.compile(r'^\^error,msg="?(.*?)"?$', re.DOTALL)
+_mi_console = re.compile(r'^~"(.*)"$', re.DOTALL)
+_mi_log = re.compile(r'^&"(.*)"$', re.DOTALL)
+
 class GdbSocket(asynchat.async_chat):
     """The gdb/mi socket connection."""
 
@@ -289,19 +387,13 @@ class GdbSocket(asynchat.async_chat):
         self.state = self.ST_INIT
         self.gdb_version = None
         self.set_terminator(b'\n')
-        self.ibuff = io.StringIO() if PY3 else StringIO.StringIO()
-
-        # Setup gdb to not stop the inferior on the following signals.
-        self.cli_command('handle SIGPIPE noprint')
-        self.cli_command('handle SIGUSR1 noprint')
-        self.cli_command('handle SIGUSR2 noprint')
-        self.cli_command('handle SIGALRM noprint')
-        self.cli_command('handle SIGCHLD noprint')
-        self.cli_command('handle SIGABRT noprint')
-        self.cli_command('handle SIGKILL noprint')
-        self.cli_command('handle SIGTERM noprint')
-        self.cli_command('handle SIGXFSZ noprint')
-        self.cli_command('handle SIGINT noprint')
+        self.ibuff = []
+
+        # Setup gdb to not stop the inferior on the following signals. The
+        # 'handle' command accepts a list of signals, so this is a single
+        # gdb/MI exchange instead of one per signal.
+        self.cli_command('handle SIGPIPE SIGUSR1 SIGUSR2 SIGALRM SIGCHLD'
+                         ' SIGABRT SIGKILL SIGTERM SIGXFSZ SIGINT noprint')
 
     def handle_error(self):
         self.close()
@@ -350,16 +442,16 @@ class GdbSocket(asynchat.async_chat):
         connect_process(asock, self.ctx, self.proc_iut, address=self.address)
 
     def collect_incoming_data(self, data):
-        self.ibuff.write(_decode(data))
+        self.ibuff.append(_decode(data))
 
     def found_terminator(self):
-        line = self.ibuff.getvalue()
-        self.ibuff = io.StringIO() if PY3 else StringIO.StringIO()
+        line = ''.join(self.ibuff)
+        del self.ibuff[:]
         if self.verbose:
             printflush(line)
         elif line.startswith('~"->'):
-            line = line[1:].strip('"')
-            line = line[:-2] if line.endswith(r'\n') else line
+            matchobj = _mi_curline.match(line)
+            line = matchobj.group(1) if matchobj else line[1:].strip('"')
             if self.ctx:
                 self.ctx.stmt.set_line(line)
             else:
@@ -381,7 +473,10 @@ class GdbSocket(asynchat.async_chat):
         elif line.startswith(error_prefix):
             # Do not overwrite the first error message.
             if self.state != self.ST_EXIT:
-                err = line[len(error_prefix):].strip('"').replace(r'\n', '\n')
+                matchobj = _mi_error.match(line)
+                err = (matchobj.group(1) if matchobj else
+                       line[len(error_prefix):].strip('"')).replace(
+                                                            r'\n', '\n')
                 self.exit(err)
 
         elif line.startswith('*stopped,'):
@@ -402,12 +497,16 @@ class GdbSocket(asynchat.async_chat):
                     self.exit()
 
         elif line.startswith('&"') and not line.startswith('&"warning:'):
-            line = line[1:].strip('"').replace(r'\n', '')
+            matchobj = _mi_log.match(line)
+            line = (matchobj.group(1) if matchobj else
+                    line[1:].strip('"')).replace(r'\n', '')
             if line:
                 print(line)
 
         elif self.state == self.ST_PDB and line.startswith('~'):
-            lines = line[1:].strip('"').replace(r'\n', '\n')
+            matchobj = _mi_console.match(line)
+            lines = (matchobj.group(1) if matchobj else
+                     line[1:].strip('"')).replace(r'\n', '\n')
             ok = self.process_result(lines)
             if ok:
                 self.exit()
@@ -626,6 +725,16 @@ def main():
             'that has registered a handler for this signal with the '
             'pdbhandler.register() function and attach to the process;'
             ' SIGNUM default value is \'%(const)s\'')
+    parser.add_argument('-m', '--many', metavar='HOST:PORT', action='append',
+            help='attach to this target as part of a concurrent scripted'
+            ' pass over all the \'--many\' targets; may be repeated;'
+            ' requires Python 3')
+    parser.add_argument('-c', '--command', metavar='CMD', action='append',
+            dest='commands',
+            help='a pdb command to run on each \'--many\' target; may be'
+            ' repeated, the commands are run in order; the default is'
+            ' \'where\' and \'detach\' is appended when the list does not'
+            ' end the session')
     parser.add_argument('host', nargs='?', default=DFLT_ADDRESS[0],
             help='default: %(default)s')
     parser.add_argument('port', nargs='?', default=DFLT_ADDRESS[1], type=int,
@@ -633,6 +742,19 @@ def main():
     args = parser.parse_args()
 
     address = (args.host, args.port)
+    if args.many:
+        if not PY3:
+            parser.error("the '--many' option requires Python 3.")
+        targets = []
+        for target in args.many:
+            host, _, port = target.rpartition(':')
+            try:
+                targets.append((host or DFLT_ADDRESS[0], int(port)))
+            except ValueError:
+                parser.error("invalid '--many' target: %s" % target)
+        from . import attach_async
+        errors = attach_async.attach_many(targets, args.commands)
+        sys.exit(1 if errors else 0)
     if args.pid is not None:
         if args.kill is not None:
             if sys.platform.startswith("win"):
@@ -0,0 +1,175 @@
+# vi:set ts=8 sts=4 sw=4 et tw=80:
+"""Attach to many remote Pdb instances concurrently.
+
+This module requires Python 3.5 or above and complements attach.py: instead
+of an interactive session driven by the asyncore event loop, a scripted list
+of pdb commands is pipelined to every (host, port) target and each target's
+results are printed as soon as that target completes. Inspecting a fleet of
+processes is one concurrent pass instead of a serial session per process.
+"""
+
+import sys
+import struct
+import asyncio
+
+from . import pdb
+from .attach import prompts, line_prmpts, printflush
+
+# Commands after which the remote Pdb instance closes the session by itself.
+_last_commands = ('detach', 'quit', 'q', 'exit')
+
+def _prompt_length(content):
+    """Return the length of the pdb prompt ending 'content', or zero."""
+    if content.endswith(line_prmpts) or content in prompts:
+        for i in range(len(prompts)):
+            if content.endswith(line_prmpts[i]) or content == prompts[i]:
+                return len(prompts[i])
+    return 0
+
+class _Connection:
+    """The connection to one remote Pdb instance."""
+
+    def __init__(self, reader, writer):
+        self.reader = reader
+        self.writer = writer
+        self.framed = None
+        self.at_eof = False
+        self.pid = 0
+        self.remote = ''
+
+    async def read_payload(self):
+        """Return the payload of the next frame.
+
+        When the remote debugger is from a previous pdb-clone release and
+        does not frame its output, return whatever bytes are available.
+        """
+        magic_len = len(pdb.FRAME_MAGIC)
+        if self.framed is None:
+            head = await self.reader.readexactly(magic_len)
+            self.framed = head == pdb.FRAME_MAGIC
+            if not self.framed:
+                return head + await self.reader.read(8192)
+        elif not self.framed:
+            data = await self.reader.read(8192)
+            if not data:
+                raise asyncio.IncompleteReadError(data, None)
+            return data
+        else:
+            head = await self.reader.readexactly(magic_len)
+            if head != pdb.FRAME_MAGIC:
+                raise ValueError('invalid frame received from the remote pdb')
+        length = struct.unpack('>I', await self.reader.readexactly(
+                                    pdb.FRAME_HEADER_SIZE - magic_len))[0]
+        return await self.reader.readexactly(length)
+
+    @staticmethod
+    def _strip_context(payload):
+        """Strip the context bundle pushed by the remote pdb.
+
+        The scripted session has no use for the bundle, see CONTEXT_MAGIC
+        in pdb.py.
+        """
+        magic = pdb.CONTEXT_MAGIC.encode('utf-8')
+        if payload.startswith(magic):
+            idx = payload.find(b'\n')
+            if idx != -1:
+                payload = payload[idx + 1:]
+        return payload
+
+    async def read_interaction(self):
+        """Return the remote output up to the next pdb prompt.
+
+        The PROCESS_PID and PROCESS_NAME header lines are consumed and
+        stored. Return the truncated output when the remote end closes the
+        connection, which is expected after a 'detach' or 'quit' command.
+        """
+        content = ''
+        while True:
+            try:
+                payload = await self.read_payload()
+            except (asyncio.IncompleteReadError, ConnectionError):
+                self.at_eof = True
+                return content
+            content += self._strip_context(payload).decode('utf-8')
+            while not self.remote and '\n' in content:
+                line, _, rest = content.partition('\n')
+                if line.startswith('PROCESS_PID:'):
+                    self.pid = int(line.split(':')[1])
+                    content = rest
+                elif line.startswith('PROCESS_NAME:'):
+                    self.remote = line.split(':', 1)[1]
+                    content = rest
+                else:
+                    break
+            if _prompt_length(content):
+                return content
+
+async def _attach_target(address, commands):
+    """Run 'commands' on the remote Pdb instance at 'address'.
+
+    Return the _Connection instance and the session transcript.
+    """
+    reader, writer = await asyncio.open_connection(address[0], address[1])
+    conn = _Connection(reader, writer)
+    try:
+        transcript = await conn.read_interaction()
+        for command in commands:
+            if conn.at_eof:
+                break
+            writer.write(('%s\n' % command).encode('utf-8'))
+            await writer.drain()
+            transcript += command + '\n'
+            transcript += await conn.read_interaction()
+    finally:
+        writer.close()
+    return conn, transcript
+
+async def _run_target(address, commands, stdout, timeout, errors):
+    tag = '%s:%s' % address
+    try:
+        conn, transcript = await asyncio.wait_for(
+                            _attach_target(address, commands), timeout)
+    except Exception as err:
+        errors[address] = err
+        printflush('---- %s ----' % tag, file=stdout)
+        printflush('Error: %s' % err, file=stdout)
+        return
+    header = '---- %s' % tag
+    if conn.remote:
+        header += ' %s' % conn.remote
+    if conn.pid:
+        header += ' (pid %d)' % conn.pid
+    header += ' ----'
+    printflush(header, file=stdout)
+    printflush(transcript.rstrip('\n'), file=stdout)
+
+async def _attach_all(addresses, commands, stdout, timeout, errors):
+    await asyncio.gather(*[_run_target(address, commands, stdout, timeout,
+                                errors) for address in addresses])
+
+def attach_many(addresses, commands=None, stdout=None, timeout=60):
+    """Run a list of pdb commands on many remote Pdb instances concurrently.
+
+    'addresses' is a sequence of (host, port) tuples, 'commands' a sequence
+    of pdb commands run in order on each target, 'where' by default. A
+    'detach' command is appended when the list does not already end the
+    session, so that every target is released from pdb control. Each
+    target's transcript is printed to 'stdout' as the target completes.
+    Return a dictionary mapping the addresses that failed to the
+    corresponding exception.
+    """
+    if not commands:
+        commands = ['where']
+    commands = [c.strip() for c in commands if c.strip()]
+    if not commands or commands[-1].split()[0] not in _last_commands:
+        commands.append('detach')
+    if stdout is None:
+        stdout = sys.stdout
+    errors = {}
+    loop = asyncio.new_event_loop()
+    try:
+        loop.run_until_complete(_attach_all(list(addresses), commands,
+                                            stdout, timeout, errors))
+    finally:
+        loop.close()
+    return errors
@@ -19,6 +19,13 @@ import itertools
 import types
 import tempfile
 import shutil
+import marshal
+import hashlib
+import threading
+try:
+    from threading import get_ident as _thread_ident    # Python 3
+except ImportError:
+    from thread import get_ident as _thread_ident       # Python 2
 from bisect import bisect
 from operator import attrgetter
 from inspect import CO_GENERATOR
@@ -107,7 +114,18 @@ _modules = {}
 _module_finder = ModuleFinder()
 _casesensitive_fs = case_sensitive_file_system()
 
-def all_pathnames(abspath):
+# The path resolution index: '_canonic_cache' maps every observed spelling
+# of a filename to its canonical form, '_pathnames_cache' maps a canonical
+# filename to the tuple of its known pathnames. The filesystem is accessed
+# only on first sight of a spelling, further breakpoint registrations and
+# tracer filename lookups cost a dictionary hit. The index assumes a stable
+# current working directory, as all_pathnames() always did for the relative
+# co_filename spellings; it is cleared by Bdb.restart() along with the other
+# source caches.
+_canonic_cache = {}
+_pathnames_cache = {}
+
+def _iter_pathnames(abspath):
     yield abspath
     cwd = os.getcwd()
     if not _casesensitive_fs:
@@ -122,13 +140,34 @@ def all_pathnames(abspath):
         if os.path.isfile(relpath):
             yield relpath
 
+def all_pathnames(abspath):
+    try:
+        return _pathnames_cache[abspath]
+    except KeyError:
+        pathnames = tuple(_iter_pathnames(abspath))
+        _pathnames_cache[abspath] = pathnames
+        return pathnames
+
+# The process-wide case folded filename table of the _bdb module, shared
+# with the tracer instances.
+_lower_filename = getattr(_bdb, 'lower_filename', None) if _bdb else None
+
 def canonic(filename):
+    try:
+        return _canonic_cache[filename]
+    except KeyError:
+        pass
     if filename[:1] + filename[-1:] == '<>':
-        return filename
-    pathname = os.path.normcase(os.path.abspath(filename))
-    # On Mac OS X, normcase does not convert the path to lower case.
-    if not _casesensitive_fs:
-        pathname = pathname.lower()
+        pathname = filename
+    else:
+        pathname = os.path.normcase(os.path.abspath(filename))
+        # On Mac OS X, normcase does not convert the path to lower case.
+        if not _casesensitive_fs:
+            if _lower_filename is not None:
+                pathname = _lower_filename(pathname)
+            else:
+                pathname = pathname.lower()
+    _canonic_cache[filename] = pathname
     return pathname
 
 def code_line_numbers(code):
@@ -179,10 +218,13 @@ class IntegersCache:
     breakpoint line number.
 
     """
-    def __init__(self, cache):
+    def __init__(self, cache, tracer=None):
         self.cache = cache
         self.refs = []
         self.len = 0
+        # The tracer breakpoint caches are invalidated whenever the cache is
+        # updated, i.e. whenever the set of breakpoints changes.
+        self.tracer = tracer
 
     def add(self, i):
         if i >= self.len:
@@ -192,9 +234,13 @@ class IntegersCache:
             self.len = i + 1
         self.cache[i] = i
         self.refs[i] += 1
+        if self.tracer is not None:
+            self.tracer.bkpt_invalidate()
         return i
 
     def delete(self, i):
+        if self.tracer is not None:
+            self.tracer.bkpt_invalidate()
         if i < self.len and self.cache[i] is not None:
             self.refs[i] -= 1
             if not self.refs[i]:
@@ -215,12 +261,109 @@ class IntegersCache:
     def __repr__(self):
         return '\n'.join((str(self.cache), str(self.refs), str(self.len)))
 
+# Persistent cache of the tables derived from a module source: the function
+# name to first line number mapping built by get_func_lno() and the flattened
+# code line number table walked by get_actual_bp(). The cache entries are
+# keyed on the source mtime and size, like pyc files, so that restoring the
+# breakpoints of a .pdbrc on a warm start does not compile or parse any of
+# the debuggee modules.
+_LINE_CACHE_VERSION = 1
+_line_cache_dir = None
+
+def _get_line_cache_dir():
+    global _line_cache_dir
+    if _line_cache_dir is None:
+        cache_home = os.environ.get('XDG_CACHE_HOME')
+        if not cache_home:
+            cache_home = os.path.join(os.path.expanduser('~'), '.cache')
+        _line_cache_dir = os.path.join(cache_home, 'pdb_clone')
+    return _line_cache_dir
+
+def _line_cache_path(filename):
+    if PY3:
+        digest = hashlib.md5(filename.encode('utf-8')).hexdigest()
+    else:
+        digest = hashlib.md5(filename).hexdigest()
+    return os.path.join(_get_line_cache_dir(), digest + '.lnotab')
+
+def _load_line_cache(filename):
+    """Return the valid cache entry of 'filename', or None."""
+    try:
+        st = os.stat(filename)
+    except OSError:
+        return None
+    try:
+        with open(_line_cache_path(filename), 'rb') as f:
+            entry = marshal.load(f)
+    except (IOError, OSError, EOFError, ValueError, TypeError):
+        return None
+    if (not isinstance(entry, dict) or
+            entry.get('version') != _LINE_CACHE_VERSION or
+            entry.get('mtime') != int(st.st_mtime) or
+            entry.get('size') != st.st_size):
+        return None
+    return entry
+
+def _save_line_cache(filename, functions_firstlno, codetab):
+    """Write the cache entry of 'filename', failures are ignored."""
+    try:
+        st = os.stat(filename)
+    except OSError:
+        return
+    entry = {'version': _LINE_CACHE_VERSION,
+             'mtime': int(st.st_mtime), 'size': st.st_size,
+             'functions_firstlno': functions_firstlno, 'codetab': codetab}
+    dirname = _get_line_cache_dir()
+    tmpname = None
+    try:
+        if not os.path.isdir(dirname):
+            os.makedirs(dirname)
+        # Write to a temporary file first so that a concurrent debugger never
+        # reads a partially written entry, the rename is atomic on posix.
+        fd, tmpname = tempfile.mkstemp(dir=dirname)
+        with os.fdopen(fd, 'wb') as f:
+            marshal.dump(entry, f)
+        os.rename(tmpname, _line_cache_path(filename))
+    except (IOError, OSError, ValueError):
+        if tmpname is not None:
+            try:
+                os.unlink(tmpname)
+            except OSError:
+                pass
+
+def _sorted_contains(sorted_list, item):
+    """Binary search membership test in a sorted list."""
+    idx = bisect(sorted_list, item)
+    return idx != 0 and sorted_list[idx-1] == item
+
+def _flatten_code(code, table):
+    """Append the line table of 'code' and its subcodes to 'table'.
+
+    Each entry is the tuple (code firstlineno, the sorted list of the code
+    statement line numbers, the sorted list of the subcodes first line
+    numbers, a dictionary mapping a subcode first line number to the index of
+    the subcode entry in the table). Return the index of the 'code' entry.
+    """
+    subcodes = dict((c.co_firstlineno, c) for c in code.co_consts
+                        if isinstance(c, types.CodeType) and not
+                            c.co_name.startswith('<'))
+    idx = len(table)
+    table.append(None)
+    children = {}
+    for flno in sorted(subcodes):
+        children[flno] = _flatten_code(subcodes[flno], table)
+    table[idx] = (code.co_firstlineno, sorted(code_line_numbers(code)),
+                  sorted(subcodes), children)
+    return idx
+
 class BdbModule:
     """A module.
 
     Instance attributes:
         functions_firstlno: a dictionary mapping function names and fully
         qualified method names to their first line number.
+        codetab: the flattened line number table of the module code objects,
+        see _flatten_code().
     """
 
     def __init__(self, filename):
@@ -233,15 +376,21 @@ class BdbModule:
                 id(linecache.cache[self.filename]) != id(self.linecache)):
             self.functions_firstlno = None
             self.code = None
+            self.node = None
+            self.codetab = None
+            self.actual_bps = {}
             lines = ''.join(linecache.getlines(self.filename))
             if not lines:
                 raise BdbSourceError('No lines in {}.'.format(self.filename))
-            try:
-                self.code = compile(lines, self.filename, 'exec', 0, True)
-                self.node = compile(lines, self.filename, 'exec',
-                                                    ast.PyCF_ONLY_AST, True)
-            except (SyntaxError, TypeError) as err:
-                raise BdbSyntaxError('{}: {}.'.format(self.filename, err))
+            entry = _load_line_cache(self.filename)
+            if entry is not None:
+                # Warm start: the derived tables are restored from the
+                # persistent cache and compiling the source is deferred until
+                # a table is missing from the entry.
+                self.functions_firstlno = entry['functions_firstlno']
+                self.codetab = entry['codetab']
+            if self.codetab is None:
+                self.compile_module()
             # At this point we still need to test for self.filename in
             # linecache.cache because of doctest scripts, as doctest installs a
             # hook at linecache.getlines to allow <doctest name> to be
@@ -252,6 +401,17 @@ class BdbModule:
             return True
         return False
 
+    def compile_module(self):
+        lines = ''.join(linecache.getlines(self.filename))
+        if not lines:
+            raise BdbSourceError('No lines in {}.'.format(self.filename))
+        try:
+            self.code = compile(lines, self.filename, 'exec', 0, True)
+            self.node = compile(lines, self.filename, 'exec',
+                                                ast.PyCF_ONLY_AST, True)
+        except (SyntaxError, TypeError) as err:
+            raise BdbSyntaxError('{}: {}.'.format(self.filename, err))
+
     def get_func_lno(self, funcname):
         """The first line number of the last defined 'funcname' function."""
 
@@ -276,11 +436,15 @@ class BdbModule:
                 yield name, node.lineno
 
         if self.functions_firstlno is None:
+            if self.node is None:
+                self.compile_module()
             self.functions_firstlno = {}
             for name, lineno in FuncLineno().visit(self.node):
                 if (name not in self.functions_firstlno or
                         self.functions_firstlno[name] < lineno):
                     self.functions_firstlno[name] = lineno
+            _save_line_cache(self.filename, self.functions_firstlno,
+                                                    self.get_codetab())
         try:
             return self.functions_firstlno[funcname]
         except KeyError:
@@ -298,19 +462,25 @@ class BdbModule:
         statement line number) which is at the shortest distance to line
         'lineno' and greater or equal to 'lineno'. When 'lineno' is the first
         line number of a subcode, use its first statement line instead.
+
+        The result is memoized so that repeated 'break' and 'clear' cycles
+        on the same line cost a single dictionary lookup.
         """
 
-        def _distance(code, module_level=False):
+        try:
+            return self.actual_bps[lineno]
+        except KeyError:
+            pass
+
+        def _distance(entry_idx, module_level=False):
             """The shortest distance to the next valid statement."""
-            subcodes = dict((c.co_firstlineno, c) for c in code.co_consts
-                                if isinstance(c, types.CodeType) and not
-                                    c.co_name.startswith('<'))
+            firstlineno, code_lnos, subcodes_flnos, subcodes = (
+                                                        codetab[entry_idx])
             # Get the shortest distance to the subcode whose first line number
             # is the last to be less or equal to lineno. That is, find the
             # index of the first subcode whose first_lno is the first to be
             # strictly greater than lineno.
             subcode_dist = None
-            subcodes_flnos = sorted(subcodes)
             idx = bisect(subcodes_flnos, lineno)
             if idx != 0:
                 flno = subcodes_flnos[idx-1]
@@ -318,12 +488,12 @@ class BdbModule:
 
             # Check if lineno is a valid statement line number in the current
             # code, excluding function or method definition lines.
-            code_lnos = sorted(code_line_numbers(code))
             # Do not stop at execution of function definitions.
             if not module_level and len(code_lnos) > 1:
                 code_lnos = code_lnos[1:]
-            if lineno in code_lnos and lineno not in subcodes_flnos:
-                return 0, (code.co_firstlineno, lineno)
+            if (_sorted_contains(code_lnos, lineno) and
+                    not _sorted_contains(subcodes_flnos, lineno)):
+                return 0, (firstlineno, lineno)
 
             # Compute the distance to the next valid statement in this code.
             idx = bisect(code_lnos, lineno)
@@ -334,20 +504,45 @@ class BdbModule:
             dist = actual_lno - lineno
             if subcode_dist and subcode_dist[0] < dist:
                 return subcode_dist
-            if actual_lno not in subcodes_flnos:
-                return dist, (code.co_firstlineno, actual_lno)
+            if not _sorted_contains(subcodes_flnos, actual_lno):
+                return dist, (firstlineno, actual_lno)
             else:
                 # The actual line number is the line number of the first
                 # statement of the subcode following lineno (recursively).
                 return _distance(subcodes[actual_lno])
 
-        if self.code:
-            code_dist = _distance(self.code, module_level=True)
-        if not self.code or not code_dist:
+        codetab = self.get_codetab()
+        code_dist = _distance(0, module_level=True) if codetab else None
+        if not code_dist:
             raise BdbSourceError('{}: line {} is after the last '
                 'valid statement.'.format(self.filename, lineno))
+        self.actual_bps[lineno] = code_dist[1]
         return code_dist[1]
 
+    def get_codetab(self):
+        """The flattened line number table of the module, built lazily."""
+        if self.codetab is None:
+            if self.code is None:
+                self.compile_module()
+            self.codetab = []
+            _flatten_code(self.code, self.codetab)
+            _save_line_cache(self.filename, self.functions_firstlno,
+                                                            self.codetab)
+        return self.codetab
+
+    def freeze(self):
+        """Complete the derived tables and drop the transient objects.
+
+        The codetab table is built now instead of on first use, and the
+        compiled code and AST that only serve to build the tables are
+        released. A forked child then inherits complete, effectively
+        read-only tables instead of each worker parsing the source again,
+        see Bdb.trace_forks().
+        """
+        self.get_codetab()
+        self.code = None
+        self.node = None
+
 class ModuleBreakpoints(dict):
     """The breakpoints of a module.
 
@@ -464,6 +659,18 @@ class Tracer:
         self.breakpoints = {}
         # The list of line numbers used to improve _bdb performance.
         self.linenumbers = []
+        # A dictionary mapping a code object to the is_skipped_module()
+        # verdict for that code.
+        self.skip_cache = {}
+        # An exception class or tuple of exception classes that generate a
+        # user_exception event when raised while no stepping is active.
+        self.break_exceptions = None
+        # A dictionary mapping a frame with watchpoints to the list of its
+        # entries, each entry a [name, fast slot index, old value] list
+        # managed by Bdb.set_watch(). Only the frames in this dictionary
+        # have f_trace_opcodes set, so the opcode events are confined to
+        # them.
+        self.watchpoints = {}
         self.reset()
 
     def reset(self, ignore_first_call_event=True, botframe=None):
@@ -499,6 +706,10 @@ class Tracer:
                 if (PY34 and self.stopframe is frame and
                         frame.f_code.co_flags & CO_GENERATOR):
                     return self.trace_dispatch
+                # With an exception filter armed the frame keeps its trace
+                # function, so that its exception events are delivered.
+                if self.break_exceptions is not None:
+                    return self.trace_dispatch
                 # No need to trace this function.
                 return # None
             # Ignore call events in generator except when stepping.
@@ -511,6 +722,9 @@ class Tracer:
             return self.trace_dispatch
 
         elif event == 'return':
+            if self.watchpoints:
+                # The frame is going away with its watchpoints.
+                self.watchpoints.pop(frame, None)
             if self.stop_here(frame) or frame is self.stopframe:
                 # Ignore return events in generator except when stepping.
                 if PY34:
@@ -537,6 +751,15 @@ class Tracer:
             return self.trace_dispatch
 
         elif event == 'exception':
+            # With no stepping active - the 'continue' state - stop_here()
+            # and the generator checks below cannot stop, so exceptions used
+            # as control flow by the debuggee cost almost nothing. Only the
+            # exceptions matching the break_exceptions filter do any work.
+            if self.stopframe is None and self.stop_lineno == -1:
+                if (self.break_exceptions is not None and
+                        issubclass(arg[0], self.break_exceptions)):
+                    return self.user_method(frame, self.user_exception, arg)
+                return self.trace_dispatch
             if not PY34:
                 if self.stop_here(frame):
                     return self.user_method(frame, self.user_exception, arg)
@@ -558,9 +781,37 @@ class Tracer:
                 return self.user_method(frame, self.user_exception, arg)
             return self.trace_dispatch
 
+        elif event == 'opcode':
+            # Only the frames where set_watch() has enabled opcode tracing
+            # get these events. A store rebinds the watched name, so an
+            # unchanged variable costs one identity test per entry.
+            entries = self.watchpoints.get(frame)
+            if entries is None:
+                # The last watchpoint of this frame has been cleared.
+                frame.f_trace_opcodes = False
+                return self.trace_dispatch
+            changes = None
+            f_locals = frame.f_locals
+            for entry in entries:
+                value = f_locals.get(entry[0])
+                if value is not entry[2]:
+                    if changes is None:
+                        changes = []
+                    changes.append((entry[0], entry[2], value))
+                    entry[2] = value
+            if changes:
+                return self.user_method(frame, self.user_watch, changes)
+            return self.trace_dispatch
+
     def stop_here(self, frame):
-        if self.skip_modules and self.is_skipped_module(frame):
-            return False
+        if self.skip_modules:
+            try:
+                skipped = self.skip_cache[frame.f_code]
+            except KeyError:
+                skipped = self.skip_cache[frame.f_code] = bool(
+                                            self.is_skipped_module(frame))
+            if skipped:
+                return False
         if frame is self.stopframe or self.stopframe is None:
             if self.stop_lineno == -1:
                 return False
@@ -595,6 +846,46 @@ class Tracer:
         """Return the trace object."""
         return sys.gettrace()
 
+    def settrace_thread(self, thread_id, do_set):
+        """Set or remove the trace function of another thread.
+
+        Not supported by the Python implementation: in all-threads tracing
+        mode only the threads started after trace_threads() are traced.
+        """
+        return False
+
+    def bkpt_invalidate(self):
+        """Invalidate the breakpoint lookup caches.
+
+        The Python implementation does not cache breakpoint lookups.
+        """
+        pass
+
+    def stats(self):
+        """Return the tracer statistics as a dictionary.
+
+        The Python implementation does not collect statistics.
+        """
+        return {}
+
+    def reset_stats(self):
+        """Reset the tracer statistics."""
+        pass
+
+    def set_flight_recorder(self, size):
+        """Enable or disable the flight recorder.
+
+        The Python implementation does not record events.
+        """
+        return False
+
+    def flight_recorder(self):
+        """Return the recorded events.
+
+        The Python implementation does not record events.
+        """
+        return []
+
     # The following methods are not on the fast path.
 
     def user_method(self, frame, method, *args, **kwds):
@@ -622,7 +913,21 @@ class Bdb(BdbTracer):
         skip_calls = (ModuleFinder.__call__.__code__,
                       ModuleFinder.find_module.__code__)
         BdbTracer.__init__(self, not _casesensitive_fs, skip_modules, skip_calls)
-        self.lineno_cache = IntegersCache(self.linenumbers)
+        # All-threads tracing mode, see trace_threads(). '_thread_tracer' is
+        # the per-thread tracer whose user event is being processed, the
+        # stepping methods apply to it instead of this instance.
+        self._thread_tracers = {}
+        self._thread_tracer = None
+        self._threads_lock = threading.RLock()
+        # Armed-but-dormant state, see set_dormant().
+        self._dormant = False
+        # Fork-aware tracing, see trace_forks(). The at-fork hook cannot be
+        # unregistered, it tests '_trace_forks' instead.
+        self._trace_forks = False
+        self._fork_hook_registered = False
+        # Breakpoint broadcast, see publish_breaks().
+        self._bp_table = None
+        self.lineno_cache = IntegersCache(self.linenumbers, self)
 
     # Backward compatibility.
     def canonic(self, filename):
@@ -631,6 +936,8 @@ class Bdb(BdbTracer):
     def restart(self):
         """Restart the debugger after source code changes."""
         _module_finder.reset()
+        _canonic_cache.clear()
+        _pathnames_cache.clear()
         linecache.checkcache()
         for module_bpts in self.breakpoints.values():
             module_bpts.reset()
@@ -639,10 +946,11 @@ class Bdb(BdbTracer):
         # The f_locals dictionary of the top level frame is cached to avoid
         # being overwritten by invocation of its getter frame_getlocals (see
         # frameobject.c).
-        if frame is self.topframe:
-            if not self.topframe_locals:
-                self.topframe_locals = self.topframe.f_locals
-            return self.topframe_locals
+        tracer = self._thread_tracer or self
+        if frame is tracer.topframe:
+            if not tracer.topframe_locals:
+                tracer.topframe_locals = tracer.topframe.f_locals
+            return tracer.topframe_locals
         # Get the f_locals dictionary and thus explicitly overwrite the
         # previous changes made by the user to locals in this frame (see issue
         # 9633).
@@ -660,18 +968,22 @@ class Bdb(BdbTracer):
         return False
 
     def _set_stopinfo(self, stopframe, stop_lineno):
+        # In all-threads tracing mode the stepping state belongs to the
+        # tracer of the thread whose user event is being processed.
+        tracer = self._thread_tracer or self
         # Ensure that stopframe belongs to the stack frame in the interval
-        # [self.botframe, self.topframe] and that it gets a trace function.
-        frame = self.topframe
+        # [tracer.botframe, tracer.topframe] and that it gets a trace
+        # function.
+        frame = tracer.topframe
         while stopframe and frame and frame is not stopframe:
-            if frame is self.botframe:
-                stopframe = self.botframe
+            if frame is tracer.botframe:
+                stopframe = tracer.botframe
                 break
             frame = frame.f_back
         if stopframe and not stopframe.f_trace:
-            stopframe.f_trace = self.trace_dispatch
-        self.stopframe = stopframe
-        self.stop_lineno = stop_lineno
+            stopframe.f_trace = tracer.trace_dispatch
+        tracer.stopframe = stopframe
+        tracer.stop_lineno = stop_lineno
 
     def bkpt_user_line(self, frame, module_bps):
         # Handle multiple breakpoints on the same line (issue 14789)
@@ -689,10 +1001,11 @@ class Bdb(BdbTracer):
                            (sorted(effective_bp_list), sorted(temporaries)))
 
     def stop_tracing(self, frame=None):
+        tracer = self._thread_tracer or self
         # Stop tracing, the thread trace function 'c_tracefunc' is NULL and
         # thus, call_trampoline() is not called anymore for all debug events:
         # PyTrace_CALL, PyTrace_RETURN, PyTrace_EXCEPTION and PyTrace_LINE.
-        self.settrace(False)
+        tracer.settrace(False)
 
         # See PyFrame_GetLineNumber() in Objects/frameobject.c for why the
         # local trace functions must be deleted.
@@ -700,10 +1013,10 @@ class Bdb(BdbTracer):
         # subinterpreter where lives the pdb instance, there must be no
         # references to the pdb instance.
         if not frame:
-            frame = self.topframe
+            frame = tracer.topframe
         while frame:
             del frame.f_trace
-            if frame is self.botframe:
+            if frame is tracer.botframe:
                 break
             frame = frame.f_back
 
@@ -738,6 +1051,7 @@ class Bdb(BdbTracer):
         # tracing is in use. For example when called from a signal handler and
         # within a debugging session started with runcall().
         self.settrace(False)
+        self._dormant = False
 
         if not frame:
             frame = sys._getframe().f_back
@@ -762,6 +1076,176 @@ class Bdb(BdbTracer):
 
         self.settrace(True)
 
+    def trace_threads(self):
+        """Arm tracing in all the threads, current and future.
+
+        Each thread gets its own ThreadTracer sharing the breakpoints
+        dictionary and the line numbers cache of this instance and owning
+        its stepping state, so that a breakpoint set once is hit in any
+        thread. This instance must be tracing, see set_trace() and the
+        family of run methods.
+
+        With the Python implementation of BdbTracer only the threads started
+        after this call are traced.
+        """
+        threading.settrace(self._thread_trace_hook)
+        current = _thread_ident()
+        with self._threads_lock:
+            for thread_id in sys._current_frames():
+                if thread_id == current or thread_id in self._thread_tracers:
+                    continue
+                tracer = ThreadTracer(self)
+                if tracer.settrace_thread(thread_id, True):
+                    self._thread_tracers[thread_id] = tracer
+
+    def stop_trace_threads(self):
+        """Disarm tracing in the threads armed by trace_threads()."""
+        threading.settrace(None)
+        with self._threads_lock:
+            for thread_id, tracer in list(self._thread_tracers.items()):
+                try:
+                    tracer.settrace_thread(thread_id, False)
+                except ValueError:
+                    # The thread has terminated.
+                    pass
+            self._thread_tracers.clear()
+
+    def _thread_trace_hook(self, frame, event, arg):
+        # Set by threading.settrace() and run in a newly started thread at
+        # its first debug event, replace itself with a ThreadTracer.
+        tracer = ThreadTracer(self)
+        with self._threads_lock:
+            self._thread_tracers[_thread_ident()] = tracer
+        tracer.settrace(True)
+        return tracer.trace_dispatch
+
+    def trace_forks(self):
+        """Re-arm tracing automatically in the children of os.fork().
+
+        A fork duplicates the breakpoint tables but not the trace hooks:
+        without this call a child runs untraced, and re-arming by hand has
+        each worker rebuild the parsed module tables. This call registers
+        an os.register_at_fork() hook that re-installs the trace function
+        in the child right after the fork, in the 'continue' state, so the
+        child only stops at the inherited breakpoints. The lazy BdbModule
+        tables are completed first, so that the N workers share the one
+        copy built by the parent through copy-on-write instead of parsing
+        the sources N times.
+
+        Requires os.register_at_fork(), a Python 3.7 feature.
+        """
+        if not hasattr(os, 'register_at_fork'):
+            raise BdbError('trace_forks() requires os.register_at_fork')
+        seen = set()
+        for module_bps in self.breakpoints.values():
+            module = module_bps.bdb_module
+            if id(module) not in seen:
+                seen.add(id(module))
+                module.freeze()
+        if not self._fork_hook_registered:
+            os.register_at_fork(after_in_child=self._atfork_child)
+            self._fork_hook_registered = True
+        self._trace_forks = True
+
+    def stop_trace_forks(self):
+        """Stop re-arming tracing in the children of os.fork()."""
+        self._trace_forks = False
+
+    def _atfork_child(self):
+        # Run in the child right after a fork, with the caller of os.fork()
+        # as the parent frame. Only the forking thread survives, so the
+        # per-thread tracers of the all-threads mode are stale.
+        if not self._trace_forks:
+            return
+        self._thread_tracers.clear()
+        self._thread_tracer = None
+        frame = sys._getframe().f_back
+        if self._dormant:
+            self.set_dormant(frame)
+            return
+        self.set_trace(frame)
+        # Do not stop in the child, only at breakpoints. The stepping state
+        # is assigned directly as tracing is now live and a method call
+        # here would itself be traced and stop the child.
+        self.stopframe = None
+        self.stop_lineno = -1
+
+    def publish_breaks(self, path):
+        """Publish the breakpoints to the memory-mapped table at 'path'.
+
+        The table is created when it does not exist and is re-written by
+        set_break() and by the clear methods, so that the processes
+        following the table with broadcastbp.follow_breaks() honor the
+        breakpoints of this debugger. Changes made afterwards with the
+        'enable', 'disable', 'condition' or 'ignore' pdb commands are not
+        re-published.
+        """
+        from . import broadcastbp
+        self._bp_table = broadcastbp.BreakpointTable(path, create=True)
+        self._broadcast_breaks()
+
+    def stop_publish_breaks(self):
+        """Stop publishing the breakpoints, leaving the table as it is."""
+        self._bp_table = None
+
+    def _broadcast_breaks(self):
+        if self._bp_table is None:
+            return
+        self._bp_table.publish([(bp.file, bp.line, bp.temporary, bp.cond)
+                                for bp in Breakpoint.bpbynumber if bp])
+
+    def bkpt_invalidate(self):
+        BdbTracer.bkpt_invalidate(self)
+        # Propagate to the per-thread tracers of the all-threads mode.
+        for tracer in list(self._thread_tracers.values()):
+            tracer.bkpt_invalidate()
+
+    def suspend_tracing(self):
+        """Detach the trace hooks, keeping every cache alive.
+
+        The breakpoints dictionary, the line numbers cache and the tracer
+        lookup caches are preserved, only the frame references and the
+        stepping state are dropped. Tracing can be re-armed with
+        resume_tracing() without paying initialization again.
+        """
+        self.stop_tracing()
+        self.reset()
+
+    def resume_tracing(self, frame=None):
+        """Re-arm tracing from 'frame', the caller's frame by default.
+
+        The caches kept by suspend_tracing() are reused.
+        """
+        if not frame:
+            frame = sys._getframe().f_back
+        self.set_trace(frame)
+
+    def set_dormant(self, frame=None):
+        """Arm the debugger from 'frame' without installing the trace hooks.
+
+        With no breakpoint set and no stepping active the trace function is
+        pure overhead: every debug event of every function flows through it
+        for nothing. A dormant debugger installs nothing; set_break()
+        installs the trace hooks when the first breakpoint is set. 'frame'
+        is the caller's frame by default and must still be on the frame
+        stack when the first breakpoint is set.
+        """
+        self.settrace(False)
+        if not frame:
+            frame = sys._getframe().f_back
+        self.reset(ignore_first_call_event=False, botframe=self.botframe)
+        self.topframe = frame
+        while frame:
+            if frame is self.botframe:
+                break
+            botframe = frame
+            frame = frame.f_back
+        else:
+            self.botframe = botframe
+        # Do not stop at the next debug event, only at breakpoints.
+        self._set_stopinfo(None, -1)
+        self._dormant = True
+
     def get_traceobj(self):
         # Do not raise BdbQuit when debugging is started with set_trace.
         if self.quitting and self.botframe.f_back:
@@ -778,12 +1262,17 @@ class Bdb(BdbTracer):
     def set_continue(self):
         # Don't stop except at breakpoints or when finished.
         self._set_stopinfo(None, -1)
-        if not self.has_breaks():
-            # No breakpoints; run without debugger overhead.
+        tracer = self._thread_tracer or self
+        if (not self.has_breaks() and
+                getattr(tracer, 'break_exceptions', None) is None and
+                not getattr(tracer, 'watchpoints', None)):
+            # No breakpoints, no exception filter and no watchpoints; run
+            # without debugger overhead.
             self.stop_tracing()
 
     def set_quit(self):
-        self.quitting = True
+        tracer = self._thread_tracer or self
+        tracer.quitting = True
         self.stop_tracing()
 
     # Derived classes should override the user_* methods
@@ -812,6 +1301,14 @@ class Bdb(BdbTracer):
         but only if we are to stop at or just below this level."""
         pass
 
+    def user_watch(self, frame, changes):
+        """This method is called when a watched variable has been rebound.
+
+        'changes' is a list of (name, old value, new value) tuples, see
+        set_watch().
+        """
+        pass
+
     # Derived classes and clients can call the following methods
     # to manipulate breakpoints.  These methods return an
     # error message is something went wrong, None if all is well.
@@ -836,6 +1333,18 @@ class Bdb(BdbTracer):
             for pathname in filename_paths:
                 self.breakpoints[pathname] = module_bps
 
+        # Promote a dormant debugger, now that there is a breakpoint to
+        # trace for, see set_dormant().
+        if self._dormant:
+            self._dormant = False
+            self.set_trace(self.topframe)
+            # Do not stop at the next debug event, only at breakpoints. The
+            # stepping state is assigned directly as tracing is now live and
+            # a method call here would itself be traced and stop the
+            # debuggee.
+            self.stopframe = None
+            self.stop_lineno = -1
+
         # Set the trace function when the breakpoint is set in one of the
         # frames of the frame stack.
         firstlineno, actual_lno = bp.actual_bp
@@ -849,6 +1358,7 @@ class Bdb(BdbTracer):
                 break
             frame = frame.f_back
 
+        self._broadcast_breaks()
         return bp
 
     def clear_break(self, filename, lineno):
@@ -857,6 +1367,7 @@ class Bdb(BdbTracer):
             return 'There is no breakpoint at %s:%d' % (filename, lineno)
         for bp in bplist:
             bp.deleteMe()
+        self._broadcast_breaks()
 
     def clear_bpbynumber(self, arg):
         try:
@@ -864,6 +1375,7 @@ class Bdb(BdbTracer):
         except ValueError as err:
             return str(err)
         bp.deleteMe()
+        self._broadcast_breaks()
 
     def clear_all_breaks(self):
         if not self.has_breaks():
@@ -871,6 +1383,66 @@ class Bdb(BdbTracer):
         for bp in Breakpoint.bpbynumber:
             if bp:
                 bp.deleteMe()
+        self._broadcast_breaks()
+
+    def set_watch(self, name, frame):
+        """Set a watchpoint on the local variable 'name' in 'frame'.
+
+        Opcode tracing is enabled on that frame alone and each opcode event
+        compares the fast slot of 'name' against the value it held at the
+        previous event; when the name has been rebound, a user_watch event
+        is generated with the old and new values. The other frames keep the
+        plain tracing or profiling path and the watchpoint is discarded
+        when the frame returns. Cell and free variables are not supported,
+        their fast slot holds the cell instead of the value.
+        """
+        tracer = self._thread_tracer or self
+        if sys.version_info < (3, 7):
+            raise BdbError('watchpoints require Python 3.7 or above')
+        if not hasattr(tracer, 'watchpoints'):
+            raise BdbError('watchpoints are not supported by this tracer')
+        code = frame.f_code
+        if name in code.co_cellvars or name in code.co_freevars:
+            raise BdbError("cannot watch '%s', a cell variable of '%s'" %
+                           (name, code.co_name))
+        if name not in code.co_varnames:
+            raise BdbError("'%s' is not a local variable of '%s'" %
+                           (name, code.co_name))
+        entry = [name, code.co_varnames.index(name),
+                 self.get_locals(frame).get(name)]
+        entries = tracer.watchpoints.setdefault(frame, [])
+        for other in entries:
+            if other[0] == name:
+                other[2] = entry[2]
+                break
+        else:
+            entries.append(entry)
+        frame.f_trace_opcodes = True
+        if not frame.f_trace:
+            frame.f_trace = tracer.trace_dispatch
+
+    def clear_watch(self, name, frame):
+        """Clear the watchpoint on 'name' in 'frame'.
+
+        Return an error message when no such watchpoint has been set.
+        """
+        tracer = self._thread_tracer or self
+        entries = getattr(tracer, 'watchpoints', {}).get(frame)
+        if entries:
+            for entry in entries:
+                if entry[0] == name:
+                    entries.remove(entry)
+                    if not entries:
+                        del tracer.watchpoints[frame]
+                        frame.f_trace_opcodes = False
+                    return
+        return "There is no watchpoint on '%s'" % name
+
+    def get_watches(self, frame):
+        """Return the list of the names watched in 'frame'."""
+        tracer = self._thread_tracer or self
+        return [entry[0] for entry in
+                getattr(tracer, 'watchpoints', {}).get(frame, [])]
 
     def get_bpbynumber(self, arg):
         if not arg:
@@ -1015,6 +1587,92 @@ class Bdb(BdbTracer):
         return res
 
 
+class ThreadTracer(BdbTracer):
+    """The per-thread tracer of the all-threads tracing mode.
+
+    The tracer shares the read-mostly breakpoint structures of the master
+    Bdb instance - the breakpoints dictionary and the line numbers cache -
+    and owns its stepping state, so that arming a thread does not duplicate
+    any cache. The user_* events are forwarded to the master under a lock,
+    a single thread at a time interacts with the user.
+    """
+
+    def __init__(self, master):
+        BdbTracer.__init__(self, not _casesensitive_fs, master.skip_modules,
+                                                        master.skip_calls)
+        self.master = master
+        self.breakpoints = master.breakpoints
+        self.linenumbers = master.linenumbers
+        self.break_exceptions = master.break_exceptions
+        self.reset(ignore_first_call_event=False)
+        # Do not step, only stop at breakpoints until a stepping command is
+        # issued in this thread.
+        self.stop_lineno = -1
+
+    def _forward(self, method, frame, *args):
+        master = self.master
+        with master._threads_lock:
+            master._thread_tracer = self
+            try:
+                method(frame, *args)
+            finally:
+                master._thread_tracer = None
+
+    def user_call(self, frame, argument_list):
+        self._forward(self.master.user_call, frame, argument_list)
+
+    def user_line(self, frame, breakpoint_hits=None):
+        self._forward(self.master.user_line, frame, breakpoint_hits)
+
+    def user_return(self, frame, return_value):
+        self._forward(self.master.user_return, frame, return_value)
+
+    def user_exception(self, frame, exc_info):
+        self._forward(self.master.user_exception, frame, exc_info)
+
+    def user_watch(self, frame, changes):
+        self._forward(self.master.user_watch, frame, changes)
+
+    def is_skipped_module(self, frame):
+        return self.master.is_skipped_module(frame)
+
+    def bkpt_user_line(self, frame, module_bps):
+        # Same as Bdb.bkpt_user_line for this thread's tracer.
+        firstlineno = frame.f_code.co_firstlineno
+        effective_bp_list = []
+        temporaries = []
+        for bp in module_bps[firstlineno][frame.f_lineno]:
+            stop, delete = bp.process_hit_event(frame)
+            if stop:
+                effective_bp_list.append(bp.number)
+                if bp.temporary and delete:
+                    temporaries.append(bp.number)
+        if effective_bp_list:
+            self.user_line(frame,
+                           (sorted(effective_bp_list), sorted(temporaries)))
+
+    def stop_tracing(self, frame=None):
+        # Same as Bdb.stop_tracing for this thread's tracer.
+        self.settrace(False)
+        if not frame:
+            frame = self.topframe
+        while frame:
+            del frame.f_trace
+            if frame is self.botframe:
+                break
+            frame = frame.f_back
+
+    def get_traceobj(self):
+        # Same as Bdb.get_traceobj for this thread's tracer.
+        if self.quitting and self.botframe.f_back:
+            raise BdbQuit
+        if not self.gettrace():
+            return None
+        if _bdb:
+            return self
+        else:
+            return self.trace_dispatch
+
 def set_trace():
     Bdb().set_trace()
 
@@ -1032,6 +1690,12 @@ class Breakpoint:
     next = 1        # Next bp to be assigned
     bpbynumber = [None] # Each entry is None or an instance of Bpt
 
+    # The condition compiled to a code object, cached lazily and recompiled
+    # when 'cond' changes. The C implementation of the Tracer class uses the
+    # same two attributes.
+    _cond_source = None
+    _cond_code = None
+
     def __init__(self, file, line, module, temporary=False,
                 cond=None):
         self.file = file    # This better be in canonical form!
@@ -1066,8 +1730,21 @@ class Breakpoint:
         self.hits += 1
         # A conditional breakpoint.
         if self.cond:
+            if self.cond is not self._cond_source:
+                self._cond_source = self.cond
+                try:
+                    self._cond_code = compile(self.cond,
+                                    '<breakpoint condition>', 'eval')
+                except Exception:
+                    self._cond_code = None
+            if self._cond_code is None:
+                # The condition does not compile, the most conservative
+                # thing is to stop on the breakpoint.  Don't delete
+                # temporary, as a hint to the user.
+                return True, False
             try:
-                if not eval_(self.cond, frame.f_globals, frame.f_locals):
+                if not eval_(self._cond_code, frame.f_globals,
+                             frame.f_locals):
                     return False, False
             except Exception:
                 # If the breakpoint condition evaluation fails, the most
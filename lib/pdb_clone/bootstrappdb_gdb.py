@@ -77,6 +77,86 @@ def module_fname(module):
         else:
             raise PdbFatalError('module_fname:\n%s' % err.strip())
 
+_ATTACH_CACHE_VERSION = 1
+
+def _attach_cache_path():
+    """Return the path of the attach cache file, or None."""
+    cachedir = os.environ.get('XDG_CACHE_HOME')
+    if not cachedir:
+        home = os.path.expanduser('~')
+        if home == '~':
+            return None
+        cachedir = os.path.join(home, '.cache')
+    cachedir = os.path.join(cachedir, 'pdb_clone')
+    try:
+        os.makedirs(cachedir)
+    except OSError:
+        pass
+    if not os.path.isdir(cachedir):
+        return None
+    return os.path.join(cachedir, 'gdb_attach_cache')
+
+def _load_attach_cache(executable):
+    """Return the cached lookup results for 'executable', or None.
+
+    The lookups made by the py-pdb command that depend only on the inferior
+    executable - the _pdbhandler module path found by spawning the inferior
+    python, the dlopen symbol check and the RTLD_NOW value - are cached on
+    disk across attaches. An entry is stale when the executable has been
+    rebuilt since the entry was written.
+    """
+    path = _attach_cache_path()
+    if not path:
+        return None
+    try:
+        mtime = int(os.stat(executable).st_mtime)
+        f = open(path)
+    except (OSError, IOError):
+        return None
+    try:
+        for line in f:
+            fields = line.rstrip('\n').split('\t')
+            if len(fields) != 6 or fields[0] != str(_ATTACH_CACHE_VERSION):
+                continue
+            if fields[1] == executable and fields[2] == str(mtime):
+                return {'mpath': fields[3],
+                        'has_dlopen': fields[4] == '1',
+                        'rtld_now': int(fields[5]) if fields[5] else None}
+    finally:
+        f.close()
+    return None
+
+def _save_attach_cache(executable, mpath, has_dlopen, rtld_now):
+    """Record the lookup results for 'executable' in the attach cache."""
+    path = _attach_cache_path()
+    if not path:
+        return
+    try:
+        mtime = int(os.stat(executable).st_mtime)
+    except OSError:
+        return
+    lines = ['\t'.join((str(_ATTACH_CACHE_VERSION), executable, str(mtime),
+                        mpath, '1' if has_dlopen else '0',
+                        '' if rtld_now is None else str(rtld_now))) + '\n']
+    try:
+        f = open(path)
+    except (OSError, IOError):
+        pass
+    else:
+        lines.extend(line for line in f
+                     if line.split('\t')[1:2] != [executable])
+        f.close()
+    # The write is atomic so that concurrent attaches never see a truncated
+    # cache. The cache is bounded to the most recent executables.
+    content = ''.join(lines[:32])
+    try:
+        fd, tmpname = tempfile.mkstemp(dir=os.path.dirname(path))
+        os.write(fd, content.encode('utf-8') if PY3 else content)
+        os.close(fd)
+        os.rename(tmpname, path)
+    except (OSError, IOError):
+        pass
+
 def get_curline():
     """Return the current python source line."""
     if Frame:
@@ -228,15 +308,28 @@ class PyPdb(gdb.Command):
 
         loader = ''
         if not gdb.lookup_symbol('bootstrappdb_string')[0]:
-            mpath = module_fname('pdb_clone._pdbhandler')
-            if not os.path.isfile(mpath):
-                raise PdbFatalError('%s does not exist.' % mpath)
+            # The module path, the dlopen symbol check and the RTLD_NOW
+            # value depend only on the inferior executable and are cached
+            # across attaches; computing them spawns the inferior python and
+            # possibly a compiler.
+            executable = gdb.progspaces()[0].filename
+            cached = _load_attach_cache(executable)
+            if cached and os.path.isfile(cached['mpath']):
+                mpath = cached['mpath']
+                has_dlopen = cached['has_dlopen']
+                flag = cached['rtld_now']
+            else:
+                mpath = module_fname('pdb_clone._pdbhandler')
+                if not os.path.isfile(mpath):
+                    raise PdbFatalError('%s does not exist.' % mpath)
+                has_dlopen = os.name == 'posix' and is_symbol('dlopen')
+                flag = dlopen_flag('RTLD_NOW') if has_dlopen else None
+                _save_attach_cache(executable, mpath, has_dlopen, flag)
 
             # Try first dlopen on unix.
-            if os.name == 'posix' and is_symbol('dlopen'):
+            if has_dlopen:
                 if in_dlopen:
                     raise PdbLocalError('Stopped within dlopen.')
-                flag = dlopen_flag('RTLD_NOW')
                 if (isinstance(flag, int) and
                         gdb_execute('call dlopen("%s", %d)' %
                                             (mpath, flag)) != '0'):
@@ -0,0 +1,194 @@
+# vi:set ts=8 sts=4 sw=4 et tw=80:
+"""Cross-process breakpoint broadcast over a memory-mapped table.
+
+One debugging session publishes its breakpoints to a small memory-mapped
+table and every worker of a multi-process service follows the table: a
+breakpoint is set once and the whole fleet honors it. The worker that hits
+the breakpoint opens its remote debugging socket, announces the address on
+stderr and waits for a pdb-attach connection.
+
+Publisher, from the controlling debugger:
+
+    pdb_instance.publish_breaks('/run/myservice/bp-table')
+
+Follower, from the main thread of each worker at start up:
+
+    from pdb_clone import broadcastbp
+    broadcastbp.follow_breaks('/run/myservice/bp-table')
+
+The followers poll the table generation counter from a daemon thread, one
+memory read per poll interval when nothing changed, so the tracing hot path
+is not involved at all. The table is written by a single publisher at a
+time; concurrent publishers overwrite each other's breakpoints.
+"""
+
+# Python 2-3 compatibility.
+from __future__ import absolute_import
+from __future__ import division
+from __future__ import print_function
+
+import os
+import sys
+import json
+import mmap
+import struct
+import threading
+
+from . import DFLT_ADDRESS
+from . import bdb
+
+TABLE_MAGIC = b'PDBB'
+TABLE_VERSION = 1
+TABLE_SIZE = 65536
+
+# The table header: magic, version, two bytes of padding, the generation
+# counter and the payload length. The payload, a json encoded list of
+# (filename, lineno, temporary, cond) items, follows the header.
+_HEADER = struct.Struct('<4sHxxQI')
+_GENERATION_OFFSET = 8
+
+class BreakpointTable:
+    """The memory-mapped table, a single writer and many readers.
+
+    Readers detect updates with the generation counter alone. The counter
+    is incremented before and after each write, as in a seqlock: an odd
+    value or a value that changed while the payload was being read means a
+    torn snapshot and the reader retries at the next poll.
+    """
+
+    def __init__(self, path, create=False):
+        # Either side may come up first, so the file is always created when
+        # missing. Until the writer has published once, the zeroed header
+        # does not carry the magic number and snapshot() returns None.
+        self.path = path
+        fd = os.open(path, os.O_RDWR | os.O_CREAT, 0o600)
+        try:
+            if os.fstat(fd).st_size < TABLE_SIZE:
+                os.ftruncate(fd, TABLE_SIZE)
+            access = mmap.ACCESS_WRITE if create else mmap.ACCESS_READ
+            self.mmap = mmap.mmap(fd, TABLE_SIZE, access=access)
+        finally:
+            os.close(fd)
+        self.generation = self.read_generation()
+        if create:
+            self.publish([])
+
+    def read_generation(self):
+        return struct.unpack_from('<Q', self.mmap, _GENERATION_OFFSET)[0]
+
+    def publish(self, bplist):
+        """Write 'bplist', a list of (filename, lineno, temporary, cond)."""
+        payload = json.dumps(bplist).encode('utf-8')
+        if _HEADER.size + len(payload) > TABLE_SIZE:
+            raise bdb.BdbError('the breakpoint table is full')
+        # Odd generation: a write is in progress.
+        generation = self.generation + 1
+        struct.pack_into('<Q', self.mmap, _GENERATION_OFFSET, generation)
+        end = _HEADER.size + len(payload)
+        self.mmap[_HEADER.size:end] = payload
+        generation += 1
+        _HEADER.pack_into(self.mmap, 0, TABLE_MAGIC, TABLE_VERSION,
+                          generation, len(payload))
+        self.generation = generation
+
+    def snapshot(self):
+        """Return (generation, bplist), or None on a torn or invalid read."""
+        generation = self.read_generation()
+        if generation & 1:
+            return None
+        magic, version, _, length = _HEADER.unpack_from(self.mmap, 0)
+        if magic != TABLE_MAGIC or version != TABLE_VERSION:
+            return None
+        payload = bytes(self.mmap[_HEADER.size:_HEADER.size + length])
+        if self.read_generation() != generation:
+            return None
+        try:
+            return generation, json.loads(payload.decode('utf-8'))
+        except ValueError:
+            return None
+
+    def close(self):
+        self.mmap.close()
+
+class _Follower(threading.Thread):
+    """Daemon thread polling the table and applying its breakpoints."""
+
+    def __init__(self, pdb_instance, table, interval):
+        threading.Thread.__init__(self, name='pdb_clone-follower')
+        self.daemon = True
+        self.pdb = pdb_instance
+        self.table = table
+        self.interval = interval
+        self.generation = None
+        self._stopped = threading.Event()
+
+    def run(self):
+        while not self._stopped.is_set():
+            if self.table.read_generation() != self.generation:
+                snapshot = self.table.snapshot()
+                if snapshot is not None:
+                    self.generation = snapshot[0]
+                    self._apply(snapshot[1])
+            self._stopped.wait(self.interval)
+
+    def _apply(self, bplist):
+        # Tracing is already live in the followed thread(s), so applying
+        # breakpoints from this thread is safe: set_break() and deleteMe()
+        # only update the shared breakpoint dictionaries and invalidate the
+        # breakpoint caches, they do not touch the trace function.
+        self.pdb.clear_all_breaks()
+        for filename, lineno, temporary, cond in bplist:
+            try:
+                self.pdb.set_break(filename, lineno, temporary, cond)
+            except bdb.BdbError:
+                # The worker may not use this module, or not at this line.
+                pass
+
+    def stop(self):
+        self._stopped.set()
+
+_follower = None
+
+def follow_breaks(path, address=(DFLT_ADDRESS[0], 0), interval=0.2,
+                  frame=None):
+    """Follow the breakpoints published in the table at 'path'.
+
+    Must be called from the main thread. The process is traced in the
+    'continue' state from the caller's frame and a daemon thread polls the
+    table, applying its breakpoints as they change. When a breakpoint is
+    hit, the process listens on 'address' - by default an ephemeral port
+    printed on stderr - and blocks until pdb-attach connects. Return the
+    Pdb instance.
+    """
+    global _follower
+    if _follower is not None:
+        raise bdb.BdbError('already following a breakpoint table')
+    from . import pdb as pdb_module
+
+    rsock = pdb_module.RemoteSocket(address)
+    rsock.announce = True
+    pdb_instance = pdb_module.Pdb(stdin=rsock, stdout=rsock)
+    rsock.context_provider = pdb_instance._context_bundle
+    if not frame:
+        frame = sys._getframe().f_back
+    pdb_instance.set_trace(frame)
+    # Do not stop at the next debug event, only at breakpoints. The
+    # stepping state is assigned directly as tracing is now live and a
+    # method call here would itself be traced and stop the debuggee.
+    pdb_instance.stopframe = None
+    pdb_instance.stop_lineno = -1
+
+    _follower = _Follower(pdb_instance, BreakpointTable(path), interval)
+    _follower.start()
+    return pdb_instance
+
+def stop_following():
+    """Stop polling the breakpoint table.
+
+    The breakpoints already applied are left in place and the process
+    remains traced.
+    """
+    global _follower
+    if _follower is not None:
+        _follower.stop()
+        _follower = None
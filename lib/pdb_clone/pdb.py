@@ -73,12 +73,14 @@ from __future__ import division
 from __future__ import print_function
 
 import os
+import io
 import re
 import sys
 import cmd
 import dis
 import code
 import glob
+import json
 import pprint
 import signal
 import errno
@@ -89,6 +91,7 @@ if not hasattr(importlib, 'find_loader'):
 import traceback
 import linecache
 import socket
+import struct
 import readline
 import shlex
 import pydoc
@@ -130,8 +133,30 @@ def user_method(user_event):
                 self.do_detach(None)
     return wrapper
 
+# The framed protocol spoken on the debugger-to-client direction of the
+# remote debugging socket: each frame is the FRAME_MAGIC marker followed by
+# the payload length as a big-endian 32 bits unsigned integer, followed by
+# the utf-8 encoded payload. The debugger output is buffered and a single
+# frame is sent per flush(), i.e. one frame per pdb prompt, instead of many
+# small writes through the text layer. The client-to-debugger direction is
+# unchanged: plain utf-8 text, one command per line.
+FRAME_MAGIC = b'PDBF'
+FRAME_HEADER_SIZE = len(FRAME_MAGIC) + 4
+
+# The context bundle pushed with each prompt on the framed protocol: a
+# single line at the start of the frame payload, CONTEXT_MAGIC followed by a
+# json object holding the pre-rendered output of the 'where' and 'list'
+# commands. The client strips the line, caches the bundle and serves those
+# commands locally, saving a round trip per stop on high latency links, see
+# AttachSocket in attach.py.
+CONTEXT_MAGIC = '#PDBCTX:'
+
 class RemoteSocket:
-    """File like class that wraps the remote debugging socket."""
+    """File like class that wraps the remote debugging socket.
+
+    Output written to the instance is accumulated in a buffer and sent as a
+    single length-prefixed frame by flush(), see FRAME_MAGIC above.
+    """
 
     ST_INIT, ST_CONNECTED, ST_CLOSED = tuple(range(3))
 
@@ -141,6 +166,14 @@ class RemoteSocket:
         self.server = None
         self.socket = None
         self.madefile = None
+        self.buffer = []
+        # Set to Pdb._context_bundle by set_trace_remote(), called before
+        # each frame is shipped, see CONTEXT_MAGIC above.
+        self.context_provider = None
+        # Print the listening address on stderr once bound, so that the
+        # address is known when binding to an ephemeral port, see the
+        # broadcastbp module.
+        self.announce = False
 
     def connect(self):
         if self.state is self.ST_INIT:
@@ -153,6 +186,9 @@ class RemoteSocket:
                 self.server.setblocking(True)
                 self.server.bind(self.addr)
                 restart_call(self.server.listen, 0)
+                if self.announce:
+                    print('pdb_clone: listening on %s:%d' %
+                          self.server.getsockname()[:2], file=sys.stderr)
                 self.socket, _ = restart_call(self.server.accept)
                 self.socket.setblocking(True)
                 self.server.close()
@@ -162,10 +198,12 @@ class RemoteSocket:
                 # debuggee may be playing tricks with the preferred encoding
                 # as in test_universal_newlines_communicate_encodings of
                 # test_subprocess.py.
+                # The file object is only used for reading the commands, the
+                # output is framed and written directly to the socket.
                 if PY3:
-                    self.madefile = self.socket.makefile('rw', encoding='utf-8')
+                    self.madefile = self.socket.makefile('r', encoding='utf-8')
                 else:
-                    self.madefile = self.socket.makefile('rw')
+                    self.madefile = self.socket.makefile('r')
             except KeyboardInterrupt:
                 self.close()
             except IOError as e:
@@ -189,6 +227,9 @@ class RemoteSocket:
         return self.state is self.ST_CONNECTED
 
     def readline(self):
+        # Make sure the pending output has been shipped to the client before
+        # blocking on the next command.
+        self.flush()
         if self.madefile:
             try:
                 line = restart_call(self.madefile.readline)
@@ -202,18 +243,27 @@ class RemoteSocket:
         return ''
 
     def write(self, data):
-        if self.madefile:
-            try:
-                return restart_call(self.madefile.write, data)
-            except IOError:
-                self.close()
-                raise
+        if self.socket:
+            self.buffer.append(data)
+            return len(data)
         return 0
 
     def flush(self):
-        if self.madefile:
+        if not self.buffer:
+            return
+        # Push the context bundle at the start of the frame, see
+        # CONTEXT_MAGIC above.
+        if self.context_provider is not None:
+            context = self.context_provider()
+            if context:
+                self.buffer.insert(0, context)
+        data = ''.join(self.buffer)
+        del self.buffer[:]
+        if self.socket:
+            payload = data.encode('utf-8') if PY3 else data
+            frame = FRAME_MAGIC + struct.pack('>I', len(payload)) + payload
             try:
-                self.madefile.flush()
+                restart_call(self.socket.sendall, frame)
             except IOError:
                 self.close()
                 raise
@@ -223,8 +273,12 @@ class RemoteSocket:
 
     def close(self):
         if self.state is self.ST_CONNECTED:
+            # Set the state first so that a failed flush() does not recurse
+            # here attempting the farewell message again.
+            self.state = self.ST_CLOSED
             try:
                 self.write('%s socket closed by pdb.\n' % str(self.addr))
+                self.flush()
             except IOError:
                 pass
         self.state = self.ST_CLOSED
@@ -369,6 +423,68 @@ class _rstr(str):
         return self
 
 
+# Approximate size in bytes of one page of repr output printed by the 'p',
+# 'pp' and 'pmore' commands.
+_REPR_PAGE_SIZE = 4096
+
+class _ReprPager:
+    """Build the repr of a builtin container one bounded page at a time.
+
+    The items are formatted one at a time with bdb.safe_repr() so that the
+    memory allocated on the debuggee and the size of each write to
+    RemoteSocket stay bounded, whatever the size of the container.
+    """
+
+    def __init__(self, obj, pretty=False):
+        self.remaining = len(obj)
+        self.exhausted = False
+        self._fragments = self._gen_fragments(obj, pretty)
+
+    def _gen_fragments(self, obj, pretty):
+        sep = ',\n ' if pretty else ', '
+        if isinstance(obj, dict):
+            start, end = '{', '}'
+        elif isinstance(obj, list):
+            start, end = '[', ']'
+        elif isinstance(obj, tuple):
+            start, end = '(', ')'
+        elif isinstance(obj, frozenset):
+            start, end = 'frozenset({', '})'
+        else:
+            start, end = '{', '}'
+        yield start
+        first = True
+        for item in obj:
+            if not first:
+                yield sep
+            first = False
+            if isinstance(obj, dict):
+                yield '%s: %s' % (bdb.safe_repr(item),
+                                  bdb.safe_repr(obj[item]))
+            else:
+                yield bdb.safe_repr(item)
+            self.remaining -= 1
+        yield end
+
+    def page(self):
+        """Return the next page of at most about _REPR_PAGE_SIZE bytes."""
+        fragments = []
+        size = 0
+        try:
+            for fragment in self._fragments:
+                fragments.append(fragment)
+                size += len(fragment)
+                if size >= _REPR_PAGE_SIZE:
+                    break
+            else:
+                self.exhausted = True
+        except RuntimeError as err:
+            # The container has been mutated between two pages.
+            fragments.append('\n<repr interrupted: %s>' % err)
+            self.exhausted = True
+        return ''.join(fragments)
+
+
 # Interaction prompt line will separate file and call info from code
 # text using value of line_prefix string.  A newline and arrow may
 # be to your liking.  You can set it once pdb is imported using the
@@ -392,6 +508,7 @@ class Pdb(bdb.Bdb, cmd.Cmd):
         self.closed = False
         self.aliases = {}
         self.displaying = {}
+        self._repr_pager = None
         self.mainpyfile = ''
         self.tb_lineno = {}
         self.forget()
@@ -588,6 +705,14 @@ class Pdb(bdb.Bdb, cmd.Cmd):
             traceback.format_exception_only(exc_type, exc_value)[-1].strip()))
         self.interaction(frame, exc_traceback)
 
+    @user_method
+    def user_watch(self, frame, changes):
+        """This function is called when a watched variable has been rebound."""
+        for name, old, new in changes:
+            self.message('--Watchpoint-- %s: %s -> %s' %
+                         (name, bdb.safe_repr(old), bdb.safe_repr(new)))
+        self.interaction(frame, None)
+
     # General interaction function
     def _cmdloop(self):
         while True:
@@ -753,6 +878,36 @@ class Pdb(bdb.Bdb, cmd.Cmd):
     def error(self, msg):
         print('***', msg, file=self.stdout)
 
+    def _context_bundle(self):
+        """Pre-render the 'where' and 'list' outputs for the remote client.
+
+        Return the context line of the framed protocol, see CONTEXT_MAGIC,
+        or None when not stopped at a prompt. The listing state is restored
+        so that a 'list' command actually sent by the client behaves as if
+        no rendering had taken place.
+        """
+        if not PY3 or self.curframe is None:
+            return None
+        save_stdout = self.stdout
+        save_lastcmd = self.lastcmd
+        save_lineno = self.lineno
+        bundle = {}
+        try:
+            self.stdout = io.StringIO()
+            self.print_stack_trace()
+            bundle['where'] = self.stdout.getvalue()
+            self.stdout = io.StringIO()
+            self.do_list('')
+            bundle['list'] = self.stdout.getvalue()
+        except Exception:
+            # Never let the prefetch break the prompt.
+            return None
+        finally:
+            self.stdout = save_stdout
+            self.lastcmd = save_lastcmd
+            self.lineno = save_lineno
+        return '%s%s\n' % (CONTEXT_MAGIC, json.dumps(bundle))
+
     # Generic completion functions.  Individual complete_foo methods can be
     # assigned below to one of these functions.
 
@@ -1151,6 +1306,47 @@ class Pdb(bdb.Bdb, cmd.Cmd):
     complete_clear = _complete_location
     complete_cl = _complete_location
 
+    def do_watch(self, arg):
+        """watch name
+        Set a watchpoint on the local variable 'name' in the current frame.
+        The debugger stops whenever the variable is bound to another object
+        and prints the old and new values.  Opcode tracing is enabled on
+        the current frame alone, so the other frames do not slow down.  The
+        watchpoint is discarded when the frame returns.  Without argument,
+        list the names watched in the current frame.
+        """
+        name = arg.strip()
+        if not name:
+            watches = self.get_watches(self.curframe)
+            if watches:
+                self.message('Watched in %s: %s' %
+                    (self.curframe.f_code.co_name, ', '.join(watches)))
+            else:
+                self.message('No watchpoint in the current frame.')
+            return
+        try:
+            self.set_watch(name, self.curframe)
+        except bdb.BdbError as err:
+            self.error(err)
+        else:
+            self.message("Watchpoint set on '%s' in %s." %
+                         (name, self.curframe.f_code.co_name))
+
+    def do_unwatch(self, arg):
+        """unwatch name
+        Clear the watchpoint set on the local variable 'name' in the
+        current frame.
+        """
+        name = arg.strip()
+        if not name:
+            self.error('A variable name is expected')
+            return
+        err = self.clear_watch(name, self.curframe)
+        if err:
+            self.error(err)
+        else:
+            self.message("Deleted the watchpoint on '%s'." % name)
+
     def do_where(self, arg):
         """w(here)
         Print a stack trace, with the most recent frame at the bottom.
@@ -1339,10 +1535,11 @@ class Pdb(bdb.Bdb, cmd.Cmd):
     def do_detach(self, arg):
         """detach
         Release the process from pdb control. Detaching the process continues
-        its execution.
+        its execution without tracing overhead. The breakpoints and the
+        tracer caches are kept alive so that the next attach does not pay
+        initialization again.
         """
-        self.clear_all_breaks()
-        self.set_continue()
+        self.suspend_tracing()
         self.close()
         return 1
 
@@ -1415,20 +1612,43 @@ class Pdb(bdb.Bdb, cmd.Cmd):
             err = traceback.format_exception_only(*exc_info)[-1].strip()
             return _rstr('** raised %s **' % err)
 
+    def _print_repr(self, obj, pretty=False):
+        """Print a large builtin container one page at a time.
+
+        Return False when 'obj' is not such a container and must be printed
+        the usual way.
+        """
+        if (type(obj) in (dict, list, tuple, set, frozenset) and
+                len(obj) > _REPR_PAGE_SIZE // 4):
+            self._repr_pager = _ReprPager(obj, pretty)
+            self._print_repr_page(self._repr_pager)
+            return True
+        return False
+
+    def _print_repr_page(self, pager):
+        self.message(pager.page())
+        if not pager.exhausted:
+            self.message('<%d more items - use the "pmore" command to print'
+                         ' the next page>' % pager.remaining)
+
     def do_p(self, arg):
         """p expression
         Print the value of the expression.
         """
         try:
-            self.message(bdb.safe_repr(self._getval(arg)))
+            obj = self._getval(arg)
         except Exception:
-            pass
+            return
+        if not self._print_repr(obj):
+            self.message(bdb.safe_repr(obj))
 
     def do_pp(self, arg):
         """pp expression
         Pretty-print the value of the expression.
         """
         obj = self._getval(arg)
+        if self._print_repr(obj, pretty=True):
+            return
         try:
             repr(obj)
         except Exception:
@@ -1436,6 +1656,16 @@ class Pdb(bdb.Bdb, cmd.Cmd):
         else:
             self.message(pprint.pformat(obj))
 
+    def do_pmore(self, arg):
+        """pmore
+        Print the next page of the repr output started by the last 'p' or
+        'pp' command on a large container.
+        """
+        if self._repr_pager is None or self._repr_pager.exhausted:
+            self.message('No more repr output to print.')
+            return
+        self._print_repr_page(self._repr_pager)
+
     complete_print = _complete_expression
     complete_p = _complete_expression
     complete_pp = _complete_expression
@@ -1647,6 +1877,46 @@ class Pdb(bdb.Bdb, cmd.Cmd):
         else:
             code.interact("*interactive*", local=ns)
 
+    def do_flightrecorder(self, arg):
+        """flightrecorder [size | off]
+
+        Without argument, print the events recorded by the flight recorder,
+        oldest first. With a 'size' argument, enable the flight recorder: the
+        last 'size' call and return events seen by the tracer are recorded in
+        a preallocated ring buffer at near-zero overhead. With 'off', disable
+        the recorder and release the buffer. The flight recorder requires the
+        _bdb extension module.
+        """
+        arg = arg.strip()
+        if arg:
+            if arg == 'off':
+                size = 0
+            else:
+                try:
+                    size = int(arg)
+                    if size < 0:
+                        raise ValueError
+                except ValueError:
+                    self.error("Invalid size: %r" % arg)
+                    return
+            if not self.set_flight_recorder(size):
+                self.message('The flight recorder is not supported by the'
+                             ' Python implementation of the tracer.')
+            elif size:
+                self.message('Flight recorder enabled,'
+                             ' recording the last %d events.' % size)
+            else:
+                self.message('Flight recorder disabled.')
+            return
+        events = self.flight_recorder()
+        if not events:
+            self.message('The flight recorder is empty or disabled.')
+            return
+        last = events[-1][4]
+        for filename, funcname, firstlineno, event, timestamp in events:
+            self.message('%10.6f %-6s %s:%d %s' % (timestamp - last, event,
+                                        filename, firstlineno, funcname))
+
     def do_alias(self, arg):
         """alias [name [command [parameter parameter ...] ]]
         Create an alias called 'name' that executes 'command'.  The
@@ -1891,9 +2161,10 @@ if __doc__ is not None:
     # unfortunately we can't guess this order from the class definition
     _help_order = [
         'help', 'where', 'down', 'up', 'break', 'tbreak', 'clear', 'disable',
-        'enable', 'ignore', 'condition', 'commands', 'step', 'next', 'until',
+        'enable', 'ignore', 'condition', 'commands', 'watch', 'unwatch',
+        'step', 'next', 'until',
         'jump', 'return', 'retval', 'run', 'continue', 'list', 'longlist',
-        'args', 'p', 'pp', 'whatis', 'source', 'display', 'undisplay',
+        'args', 'p', 'pp', 'pmore', 'whatis', 'source', 'display', 'undisplay',
         'thread', 'interact', 'alias', 'unalias', 'debug', 'detach', 'quit',
     ]
 
@@ -1922,7 +2193,13 @@ def runcall(*args, **kwds):
 def set_trace():
     Pdb().set_trace(sys._getframe().f_back)
 
+# The Pdb instance parked by the last detach, reused by set_trace_remote()
+# with its warm caches, see Bdb.suspend_tracing().
+_remote_pdb = None
+
 def set_trace_remote(host=b'127.0.0.1', port=7935, frame=None):
+    global _remote_pdb
+
     # When the set_trace_remote() hard-coded breakpoint is set in a loop
     # iterating over sys.modules, allowing 'host' to be an str instance could
     # possibly raise a RuntimeError (dictionary changed size) after the bind()
@@ -1931,10 +2208,18 @@ def set_trace_remote(host=b'127.0.0.1', port=7935, frame=None):
         raise ValueError("'host' must be a bytes object.")
 
     rsock = RemoteSocket((host, port))
-    pdb = Pdb(stdin=rsock, stdout=rsock)
     if not frame:
         frame = sys._getframe().f_back
-    pdb.set_trace(frame)
+    if _remote_pdb is not None and _remote_pdb.stdin.closed():
+        pdb = _remote_pdb
+        pdb.stdin = pdb.stdout = rsock
+        rsock.context_provider = pdb._context_bundle
+        pdb.resume_tracing(frame)
+    else:
+        pdb = Pdb(stdin=rsock, stdout=rsock)
+        _remote_pdb = pdb
+        rsock.context_provider = pdb._context_bundle
+        pdb.set_trace(frame)
     return rsock
 
 # Post-Mortem interface
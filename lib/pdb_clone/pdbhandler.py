@@ -11,35 +11,58 @@ if sys.platform.startswith('win'):
     raise ImportError('The pdbhandler module is not supported on Windows.')
 
 import signal
-from pdb_clone import _pdbhandler, DFLT_ADDRESS
+from pdb_clone import PY3, _pdbhandler, DFLT_ADDRESS
 from collections import namedtuple
 
-Handler = namedtuple('Handler', 'host, port, signum')
+Handler = namedtuple('Handler', 'host, port, signum, action')
+
+# The handler actions.
+ACTION_ATTACH = 0       # Start a remote debugging session.
+ACTION_DUMP = 1         # Print the traceback of all threads.
 
 def register(host=DFLT_ADDRESS[0], port=DFLT_ADDRESS[1],
-             signum=signal.SIGUSR1):
+             signum=signal.SIGUSR1, action=ACTION_ATTACH):
     """Register a pdb handler for signal 'signum'.
 
-    The handler sets pdb to listen on the ('host', 'port') internet address
-    and to start a remote debugging session on accepting a socket connection.
+    With ACTION_ATTACH, the default, the handler sets pdb to listen on the
+    ('host', 'port') internet address and to start a remote debugging
+    session on accepting a socket connection. With ACTION_DUMP, the handler
+    prints the traceback of all the threads with faulthandler. Several
+    signals may be registered, each with its own action.
+
+    Actions other than ACTION_ATTACH require Python 3.
     """
-    _pdbhandler._register(host, port, signum)
+    if PY3:
+        _pdbhandler._register(host, port, signum, action)
+    else:
+        # The Python 2 extension implements the single signal API.
+        if action != ACTION_ATTACH:
+            raise ValueError(
+                'actions other than ACTION_ATTACH require Python 3')
+        _pdbhandler._register(host, port, signum)
 
-def unregister():
-    """Unregister the pdb handler.
+def unregister(signum=0):
+    """Unregister the pdb handler for 'signum', or all of them when zero.
 
-    Do nothing when no handler has been registered.
+    Do nothing when no matching handler has been registered.
     """
-    _pdbhandler._unregister()
+    if PY3:
+        _pdbhandler._unregister(signum)
+    else:
+        _pdbhandler._unregister()
 
-def get_handler():
-    """Return the handler as a named tuple.
+def get_handler(signum=0):
+    """Return the handler for 'signum' as a named tuple.
 
-    The named tuple attributes are 'host', 'port', 'signum'.
-    Return None when no handler has been registered.
+    The named tuple attributes are 'host', 'port', 'signum', 'action'. When
+    'signum' is zero, the first registered handler is returned. Return None
+    when no matching handler has been registered.
     """
-    host, port, signum = _pdbhandler._registered()
+    if PY3:
+        host, port, signum, action = _pdbhandler._registered(signum)
+    else:
+        host, port, signum = _pdbhandler._registered()
+        action = ACTION_ATTACH
     if signum:
         return Handler(host if host else DFLT_ADDRESS[0].encode(),
-                       port if port else DFLT_ADDRESS[1], signum)
-
+                       port if port else DFLT_ADDRESS[1], signum, action)
@@ -16,6 +16,8 @@ import os
 import doctest
 import importlib
 import shutil
+import subprocess
+import tempfile
 from unittest import defaultTestLoader
 
 from lib.pdb_clone import __version__, PY3
@@ -123,17 +125,282 @@ class Test(Command):
         result = 'failed' if failed else 'ok'
         print('{:d} test{} {}.'.format(cnt, plural, result))
 
+# The header of the benchmark script run by the Bench command in its own
+# subprocess for each cell of the benchmark matrix. The script is completed
+# with the breakpoint target functions and the driver, see write_bench_script.
+BENCH_SCRIPT_HEADER = '''\
+# Generated by the 'bench' command of setup.py.
+import sys
+import time
+
+def recursive(n):
+    if n <= 1:
+        return 1
+    return recursive(n - 1) + recursive(n - 2)
+
+def loop(n):
+    total = 0
+    for i in range(n):
+        total += i
+    return total
+
+def _generate(n):
+    for i in range(n):
+        yield i
+
+def generator(n):
+    total = 0
+    for i in _generate(n):
+        total += i
+    return total
+
+def exception(n):
+    count = 0
+    for i in range(n):
+        try:
+            raise ValueError(i)
+        except ValueError:
+            count += 1
+    return count
+
+WORKLOADS = {'recursive': (recursive, 16), 'loop': (loop, 20000),
+             'generator': (generator, 10000), 'exception': (exception, 5000)}
+'''
+
+BENCH_SCRIPT_DRIVER = '''\
+def _count_events(func, arg):
+    # The per-event cost denominator: the number of debug events generated
+    # by one run of the workload.
+    count = [0]
+    def counter(frame, event, _arg):
+        count[0] += 1
+        return counter
+    sys.settrace(counter)
+    func(arg)
+    sys.settrace(None)
+    return count[0]
+
+def main():
+    backend, workload = sys.argv[1], sys.argv[2]
+    nbps, number = int(sys.argv[3]), int(sys.argv[4])
+    timer = getattr(time, 'perf_counter', time.time)
+    func, arg = WORKLOADS[workload]
+    events = _count_events(func, arg)
+    if backend == 'none':
+        runs = []
+        for _ in range(number):
+            start = timer()
+            func(arg)
+            runs.append(timer() - start)
+    else:
+        if backend == 'pybdb':
+            # Force the 'from . import _bdb' statement of bdb.py to fail so
+            # that the pure Python Tracer fallback is benchmarked.
+            sys.modules['pdb_clone._bdb'] = None
+        from pdb_clone import bdb
+        if backend == 'cbdb' and bdb._bdb is None:
+            # The C extension is not built, run 'build_ext --inplace' first.
+            print('n/a')
+            return
+        class BenchDebugger(bdb.Bdb):
+            # Keep tracing without stepping, even with no breakpoint set, so
+            # that the passive tracer overhead is what gets measured. The
+            # breakpoints are set on lines that are never executed.
+            def user_call(self, frame, argument_list):
+                self._set_stopinfo(None, -1)
+            def user_line(self, frame, breakpoint_hits=None):
+                self._set_stopinfo(None, -1)
+        debugger = BenchDebugger()
+        for lineno in BP_LINES[:nbps]:
+            debugger.set_break(__file__, lineno)
+        runs = []
+        for _ in range(number):
+            start = timer()
+            debugger.runcall(func, arg)
+            runs.append(timer() - start)
+    print('%.2f' % (min(runs) * 1e9 / events))
+
+if __name__ == '__main__':
+    main()
+'''
+
+class Bench(Command):
+    description = 'run the tracer benchmark matrix'
+
+    user_options = [
+        ('baseline=', 'b',
+            'path of the baseline file (default "%s")' % 'bench-baseline.txt'),
+        ('save', 's', 'save the results as the new baseline'),
+        ('number=', 'n', 'number of timed runs per cell, the best run is'
+            ' kept (default 5)'),
+    ]
+
+    backends = ('none', 'cbdb', 'pybdb')
+    workloads = ('recursive', 'loop', 'generator', 'exception')
+    bp_counts = (0, 1, 50)
+
+    def initialize_options(self):
+        self.baseline = 'bench-baseline.txt'
+        self.save = False
+        self.number = 5
+
+    def finalize_options(self):
+        self.number = int(self.number)
+
+    @staticmethod
+    def write_bench_script(workdir):
+        """Write the benchmark script and return its path."""
+        lines = BENCH_SCRIPT_HEADER.splitlines()
+        bp_lines = []
+        for i in range(max(Bench.bp_counts)):
+            lines.append('')
+            lines.append('def _bp_target_%d(x):' % i)
+            lines.append('    return x + %d' % i)
+            bp_lines.append(len(lines))
+        lines.append('')
+        lines.append('BP_LINES = %r' % bp_lines)
+        lines.append('')
+        lines.extend(BENCH_SCRIPT_DRIVER.splitlines())
+        path = os.path.join(workdir, '_bdb_bench.py')
+        with open(path, 'w') as f:
+            f.write('\n'.join(lines) + '\n')
+        return path
+
+    def load_baseline(self):
+        baseline = {}
+        if not os.path.exists(self.baseline):
+            return baseline
+        with open(self.baseline) as f:
+            for line in f:
+                line = line.strip()
+                if not line or line.startswith('#'):
+                    continue
+                backend, workload, nbps, ns = line.split()
+                baseline[(backend, workload, int(nbps))] = float(ns)
+        return baseline
+
+    def save_baseline(self, results):
+        with open(self.baseline, 'w') as f:
+            f.write('# Benchmark baseline written by the setup.py bench'
+                    ' command.\n')
+            f.write('# backend workload breakpoints ns-per-event\n')
+            for key in sorted(results):
+                if results[key] is None:
+                    continue
+                f.write('{} {} {:d} {}\n'.format(key[0], key[1], key[2],
+                                                 results[key]))
+        print('Baseline saved to {}.'.format(self.baseline))
+
+    def run(self):
+        """Run the benchmark matrix, each cell in its own subprocess."""
+        env = dict(os.environ)
+        env['PYTHONPATH'] = os.pathsep.join([os.path.abspath('lib')] +
+                            env.get('PYTHONPATH', '').split(os.pathsep))
+        workdir = tempfile.mkdtemp()
+        results = {}
+        try:
+            script = self.write_bench_script(workdir)
+            for backend in self.backends:
+                for workload in self.workloads:
+                    for nbps in self.bp_counts:
+                        if backend == 'none' and nbps:
+                            continue
+                        out = subprocess.check_output([sys.executable,
+                                script, backend, workload, str(nbps),
+                                str(self.number)], env=env)
+                        out = out.decode().strip()
+                        results[(backend, workload, nbps)] = (
+                                float(out) if out != 'n/a' else None)
+        finally:
+            shutil.rmtree(workdir)
+
+        baseline = self.load_baseline()
+        header = '{:8} {:10} {:>4} {:>10} {:>10} {:>8}'.format(
+                'backend', 'workload', 'bps', 'ns/event', 'baseline', 'delta')
+        print(header)
+        print('-' * len(header))
+        for key in sorted(results):
+            ns = results[key]
+            if ns is None:
+                print('{:8} {:10} {:4d} {:>10}'.format(key[0], key[1],
+                                                       key[2], 'n/a'))
+                continue
+            ref = baseline.get(key)
+            if ref:
+                delta = '{:+.1f}%'.format(100 * (ns - ref) / ref)
+                print('{:8} {:10} {:4d} {:10.2f} {:10.2f} {:>8}'.format(
+                        key[0], key[1], key[2], ns, ref, delta))
+            else:
+                print('{:8} {:10} {:4d} {:10.2f}'.format(key[0], key[1],
+                                                         key[2], ns))
+        if self.save:
+            # A baseline with missing cells would silently track only the
+            # remaining backends, defeating its purpose.
+            missing = sorted(set(key[0] for key in results
+                                 if results[key] is None))
+            if missing:
+                sys.exit('error: cannot save the baseline, backend{} not'
+                         ' available: {} (run "build_ext --inplace"'
+                         ' first)'.format('s' if len(missing) > 1 else '',
+                                          ', '.join(missing)))
+            self.save_baseline(results)
+
+class CheckExt(Command):
+    description = 'check that the _bdb extension module builds and imports'
+
+    user_options = []
+
+    def initialize_options(self):
+        pass
+
+    def finalize_options(self):
+        pass
+
+    def run(self):
+        """Build the extensions in place and import _bdb in a subprocess.
+
+        The extensions are built as 'optional', so a plain build silently
+        falls back to the pure Python tracer when the compilation fails.
+        This command does fail in that case; use it as a smoke check, in
+        CI or after an upgrade of the interpreter.
+        """
+        build = self.reinitialize_command('build_ext')
+        build.inplace = 1
+        self.run_command('build_ext')
+        env = dict(os.environ)
+        env['PYTHONPATH'] = os.pathsep.join([os.path.abspath('lib')] +
+                            env.get('PYTHONPATH', '').split(os.pathsep))
+        subprocess.check_call([sys.executable, '-c',
+                'import pdb_clone._bdb'], env=env)
+        print('pdb_clone._bdb imports successfully.')
+
 with open('README.rst') as f:
     long_description = f.read()
 
 if PY3:
-    cmdclass = {'test': Test}
+    cmdclass = {'test': Test, 'bench': Bench, 'check_ext': CheckExt}
+    # On Python 3.12 and above, use the sys.monitoring (PEP 669) backend:
+    # lines without a breakpoint are disabled at the interpreter level and
+    # cost nothing.
+    _bdb_macros = []
+    if sys.version_info >= (3, 12):
+        _bdb_source = 'lib/pdb_clone/_bdbmodule-py312.c'
+    else:
+        _bdb_source = 'lib/pdb_clone/_bdbmodule-py3.c'
+        if sys.version_info >= (3, 11):
+            # On 3.11 the frame object is opaque and backed by a lightweight
+            # interpreter frame; compile the tracer against the internal
+            # frame layout, see the frame access layer in _bdbmodule-py3.c.
+            _bdb_macros = [('BDB_INTERNAL_FRAME_API', '1'),
+                           ('Py_BUILD_CORE_MODULE', '1')]
     ext_modules = [Extension('pdb_clone._bdb',
-                    sources=['lib/pdb_clone/_bdbmodule-py3.c'], optional=True),
+                    sources=[_bdb_source], define_macros=_bdb_macros,
+                    optional=True),
                    Extension('pdb_clone._pdbhandler',
                     sources=['lib/pdb_clone/_pdbhandler-py3.c'], optional=True)]
 else:
-    cmdclass={'build_ext': build_ext, 'test': Test}
+    cmdclass={'build_ext': build_ext, 'test': Test, 'bench': Bench,
+              'check_ext': CheckExt}
     ext_modules = [Extension('pdb_clone._bdb',
                     sources=['lib/pdb_clone/_bdbmodule-py27.c']),
                    Extension('pdb_clone._pdbhandler',